@@ -21,6 +21,7 @@
 */
 
 #include <cassert>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
@@ -34,7 +35,12 @@
 #include <iterator>
 #include <sstream>
 
+//With libutap the model types come from the installed library, so they match what it was built with.
+#ifdef ENABLE_LIBUTAP
+#include <utap/utap.h>
+#else
 #include "headers/system.h"
+#endif
 #include "headers/xmlwriter.h"
 
 #include <deque>
@@ -43,6 +49,30 @@
 #include <exception>
 #include <algorithm>
 #include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <memory>
+#include <memory_resource>
+#include <unordered_map>
+
+#ifdef ENABLE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef ENABLE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 /* This utility takes an UPPAAL model in the UPPAAL intermediate
  * format and a UPPAAL XTR trace file and prints trace to stdout in a
@@ -75,6 +105,7 @@ using std::stringstream;
 using std::getline;
 using std::cin;
 using std::stoi;
+using std::stoull;
 
 struct milestoneValue
 {
@@ -95,12 +126,103 @@ struct taskValue
     int value;
 };
 
+/* Names of the model are interned when it is loaded, the trace and
+ * the parsed results refer to them by symbol.
+ */
+typedef uint32_t symbol_t;
+
+/* Dense number of each task, indexed by the symbol of the task, -1 for
+ * symbols that are not tasks. The tasks are the targets of the edges
+ * that start a task, and symbol 0, for finishing when no task was
+ * started. Filled by classifyEdges.
+ */
+static vector<int> taskIds;
+
+/* The tasks an agent has finished in its current iteration, in the
+ * order they were finished. The first tasks are kept inline and the
+ * tasks numbered below 64 are also kept as bits, so in the usual games
+ * copying the set does not allocate, and testing a task and clearing
+ * the set take constant time. Further tasks go to a vector and are
+ * tested by a scan.
+ */
+class finished_tasks
+{
+public:
+    static const size_t inlineCapacity = 8;
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+
+    symbol_t at(size_t index) const
+    {
+        if (index >= count)
+        {
+            throw std::out_of_range("finished_tasks::at");
+        }
+        return index < inlineCapacity ? first[index] : more[index - inlineCapacity];
+    }
+
+    bool contains(symbol_t task) const
+    {
+        int id = task < taskIds.size() ? taskIds[task] : -1;
+        if (id >= 0 && id < 64)
+        {
+            return (bits >> id) & 1;
+        }
+        for (size_t k = 0; k < count; k++)
+        {
+            if (at(k) == task)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    //Adds the task unless it is already finished.
+    void insert(symbol_t task)
+    {
+        if (contains(task))
+        {
+            return;
+        }
+        int id = task < taskIds.size() ? taskIds[task] : -1;
+        if (id >= 0 && id < 64)
+        {
+            bits |= uint64_t(1) << id;
+        }
+        if (count < inlineCapacity)
+        {
+            first[count] = task;
+        }
+        else
+        {
+            more.push_back(task);
+        }
+        count++;
+    }
+
+    void clear()
+    {
+        bits = 0;
+        count = 0;
+        more.clear();
+    }
+
+    size_t heapSize() const { return more.capacity() * sizeof(symbol_t); }
+private:
+    uint64_t bits = 0;
+    size_t count = 0;
+    symbol_t first[inlineCapacity];
+    vector<symbol_t> more;
+};
+
 struct parsed_state_agent
 {
     int Id;
     milestoneValue Milestone;
-    string Task;
-    vector<string> FinishedTasks;
+    symbol_t Task = 0;
+    finished_tasks FinishedTasks;
     int Iteration;
 };
 
@@ -108,7 +230,7 @@ struct parsed_action_agent
 {
     int Id;
     string Type;
-    string Target;
+    symbol_t Target = 0;
     vector<int> TimeInt;
 };
 
@@ -129,13 +251,6 @@ struct parsed_result
     vector<parsed_action> Actions;
 };
 
-struct agent_locations
-{
-    int id;
-    string name;
-    vector<string> locations;
-};
-
 //Struct to improve the output of the parser.
 struct glob
 {
@@ -266,24 +381,229 @@ static vector<cell_t> layout;
 static vector<int> instructions;
 static vector<process_t> processes;
 static vector<edge_t> edges;
-static map<int, string> expressions;
+static vector<string> expressions; //Indexed by expression id.
 
 /* For convenience we keep the size of the system here.
  */
 static size_t processCount = 0;
 static size_t variableCount = 0;
 static size_t clockCount = 0;
-int unParsedTransiNameLoc = 0;
+
+/* Interned names. Each distinct name is stored once and identified by
+ * its index, so names are compared as integers and copied as such.
+ * Symbol 0 is the empty name. The table is only added to while the
+ * model is loaded, after that it is safe to read from several threads.
+ */
+class symbol_table
+{
+public:
+    symbol_table() { intern(""); }
+
+    symbol_t intern(const string& name)
+    {
+        auto found = ids.find(name);
+        if (found != ids.end())
+        {
+            return found->second;
+        }
+        symbol_t symbol = static_cast<symbol_t>(names.size());
+        names.push_back(name);
+        ids.emplace(name, symbol);
+        return symbol;
+    }
+
+    const string& name(symbol_t symbol) const { return names[symbol]; }
+private:
+    vector<string> names;
+    std::unordered_map<string, symbol_t> ids;
+};
+
+static symbol_table symbols;
+
+/* Symbols of the model names: the name of each process, the name of
+ * each cell of the layout, the name of each location prefixed with the
+ * name of its process, "process.location". Filled by
+ * internModelNames.
+ */
+static vector<symbol_t> processSymbols;
+static vector<symbol_t> cellSymbols;
+static vector<symbol_t> locationPathSymbols;
+
+/* The variables holding the milestone of each agent. Filled by
+ * resolveAgentSlots.
+ */
+static vector<vector<size_t>> agentPositionSlots;
+
+/* Finds which of a set of patterns occur in a name, in one pass over
+ * the name (Aho-Corasick). Each pattern belongs to one or more
+ * categories, given as bits, and match returns the categories of all
+ * patterns found. An empty pattern is found in every name, as with
+ * string::find. Patterns are added first and then build is called once.
+ */
+class pattern_matcher
+{
+public:
+    pattern_matcher() { clear(); }
+
+    void clear()
+    {
+        next.assign(256, -1);
+        fail.assign(1, 0);
+        categories.assign(1, 0);
+    }
+
+    void add(const string& pattern, uint32_t category)
+    {
+        int node = 0;
+        for (unsigned char c : pattern)
+        {
+            if (next[node * 256 + c] < 0)
+            {
+                next[node * 256 + c] = static_cast<int>(categories.size());
+                next.resize(next.size() + 256, -1);
+                fail.push_back(0);
+                categories.push_back(0);
+            }
+            node = next[node * 256 + c];
+        }
+        categories[node] |= category;
+    }
+
+    /* Turns the trie into an automaton: every missing step follows the
+     * failure link and every node also reports the categories of the
+     * patterns that end at its suffixes.
+     */
+    void build()
+    {
+        vector<int> queue;
+        for (int c = 0; c < 256; c++)
+        {
+            int child = next[c];
+            if (child < 0)
+            {
+                next[c] = 0;
+            }
+            else
+            {
+                fail[child] = 0;
+                queue.push_back(child);
+            }
+        }
+        for (size_t i = 0; i < queue.size(); i++)
+        {
+            int node = queue[i];
+            categories[node] |= categories[fail[node]];
+            for (int c = 0; c < 256; c++)
+            {
+                int child = next[node * 256 + c];
+                if (child < 0)
+                {
+                    next[node * 256 + c] = next[fail[node] * 256 + c];
+                }
+                else
+                {
+                    fail[child] = next[fail[node] * 256 + c];
+                    queue.push_back(child);
+                }
+            }
+        }
+    }
+
+    uint32_t match(const string& name) const
+    {
+        int node = 0;
+        uint32_t found = categories[0];
+        for (unsigned char c : name)
+        {
+            node = next[node * 256 + c];
+            found |= categories[node];
+        }
+        return found;
+    }
+private:
+    vector<int> next;
+    vector<int> fail;
+    vector<uint32_t> categories;
+};
+
+/* The categories of the location patterns of the globs. Each is a bit
+ * of the mask returned by locationPatterns.match.
+ */
+enum location_pattern_t
+{
+    MOVE_START_FROM = 1 << 0,
+    MOVE_START_TO = 1 << 1,
+    MOVE_FINISH_FROM = 1 << 2,
+    MOVE_FINISH_TO = 1 << 3,
+    TASK_START_FROM = 1 << 4,
+    TASK_START_TO = 1 << 5,
+    TASK_FINISH_FROM = 1 << 6,
+    TASK_FINISH_TO = 1 << 7
+};
+
+//Built by fillGlobs.
+static pattern_matcher locationPatterns;
 
 glob globs;
 
 vector<parsed_state> states;
 vector<parsed_action> actions;
 parsed_result results;
-vector<agent_locations> AgentsLocations;
 
-vector<vector<string>> unParsedStates;
-vector<vector<vector<string>>> unParsedTransition;
+//The agent owning each process, -1 for none. Filled by fillProcessAgents.
+static vector<int> processAgents;
+
+//Set by --legacy-reader. Reads the trace through istream instead of a memory mapping.
+bool legacyReader = false;
+
+//Set by --check-reader. Reads the trace a second time with the istream reader and compares.
+bool checkReader = false;
+
+//Set by --stream. Parses and prints each step while the trace is read.
+bool streamOutput = false;
+
+//Set by --if-cache. Loads the intermediate file from a snapshot when it has not changed.
+bool ifCache = false;
+
+//Set by --print-trace. Prints the states and transitions as text while the trace is read.
+bool printTrace = false;
+
+//Set by --verbose. Adds the guard, synchronisation and update of each edge to the printed trace.
+bool verboseTrace = false;
+
+//Set by --threads. Number of threads parsing the trace.
+unsigned traceThreads = 1;
+
+//Set by --agent-threads. Number of threads the agents are split over when the parsed states are filled.
+unsigned agentThreads = 1;
+
+//Set by --memory-limit, in bytes. Parsed steps beyond it are moved to a temporary file. 0 keeps all of them in memory.
+size_t memoryLimit = 0;
+
+/* Memory for the data of one trace. The transitions of a trace live
+ * exactly as long as the trace, so they are allocated from a monotonic
+ * buffer and released together when the arena is destroyed. An arena
+ * is used by one thread; threads working on the same trace each take
+ * a part of their own with split(), which lives as long as the arena.
+ */
+class trace_arena : public std::pmr::monotonic_buffer_resource
+{
+public:
+    trace_arena& split()
+    {
+        parts.push_back(std::make_unique<trace_arena>());
+        return *parts.back();
+    }
+private:
+    vector<std::unique_ptr<trace_arena>> parts;
+};
+
+//Declared before the transitions so it is destroyed after them.
+trace_arena traceArena;
+
+struct transition_edge;
+typedef std::pmr::vector<transition_edge> transition_record;
+vector<transition_record> unParsedTransition;
 
 /* These are mappings from variable and clock indicies to
  * the names of these variables and clocks.
@@ -292,7 +612,7 @@ static vector<string> clocks;
 static vector<string> variables;
 
 //CODE FROM https://github.com/UPPAALModelChecker/utap tracer.cpp starts here and ends on line 965 not including some parts of main
-//It does however take what the old parser would print out to the console and adds it to a list of outputs. unParsedTransitions and unParsedStates 
+//It does however take what the old parser would print out to the console and adds it to a list of outputs. unParsedTransitions and traceStates 
 
 /* Thrown by parser upon parse errors.
  */
@@ -328,9 +648,7 @@ istream& readdot(istream& is)
     }
     if (str != ".")
     {
-        cerr << "Expecting a line with '.' but got '" << str << "'" << endl;
-        assert(false);
-        exit(EXIT_FAILURE);
+        throw invalid_format("Expecting a line with '.' but got '" + str + "'");
     }
     return is;
 }
@@ -345,882 +663,3274 @@ istream& skipspaces(istream& is)
     return is;
 }
 
-/* Parser for intermediate format.
+/* A read-only memory mapping of a whole file. The trace reader walks
+ * the mapping directly instead of going through istream extraction.
  */
-void loadIF(istream& file)
+class mapped_file
 {
-    string str;
-    string section;
-    char name[32];
-    int index;
+public:
+    explicit mapped_file(const string& path);
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+    ~mapped_file();
+
+    bool is_open() const { return opened; }
+    const char* begin() const { return data; }
+    const char* end() const { return data + length; }
+private:
+    const char* data = nullptr;
+    size_t length = 0;
+    bool opened = false;
+#ifdef _WIN32
+    HANDLE fileHandle = INVALID_HANDLE_VALUE;
+    HANDLE mapHandle = nullptr;
+#endif
+};
 
-    while (getline(file, section))
+#ifdef _WIN32
+mapped_file::mapped_file(const string& path)
+{
+    fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (fileHandle == INVALID_HANDLE_VALUE)
     {
-        if (section == "layout")
-        {
-            cell_t cell;
-            while (read(file, str) && !str.empty() && !isspace(str[0]))
-            {
-                char s[5];
-                auto cstr = str.c_str();
-
-                if (sscanf(cstr, "%d:clock:%d:%31s", &index,
-                    &cell.clock.nr, name) == 3)
-                {
-                    cell.type = cell_t::CLOCK;
-                    cell.name = name;
-                    clocks.emplace_back(name);
-                    clockCount++;
-                }
-                else if (sscanf(cstr, "%d:const:%d", &index,
-                    &cell.value) == 2)
-                {
-                    cell.type = cell_t::CONST;
-                }
-                else if (sscanf(cstr, "%d:var:%d:%d:%d:%d:%31s", &index,
-                    &cell.var.min, &cell.var.max, &cell.var.init,
-                    &cell.var.nr, name) == 6)
-                {
-                    cell.type = cell_t::VAR;
-                    cell.name = name;
-                    variables.emplace_back(name);
-                    variableCount++;
-                }
-                else if (sscanf(cstr, "%d:meta:%d:%d:%d:%d:%31s", &index,
-                    &cell.meta.min, &cell.meta.max, &cell.meta.init,
-                    &cell.meta.nr, name) == 6)
-                {
-                    cell.type = cell_t::META;
-                    cell.name = name;
-                    variables.emplace_back(name);
-                    variableCount++;
-                }
-                else if (sscanf(cstr, "%d:sys_meta:%d:%d:%31s", &index,
-                    &cell.sys_meta.min, &cell.sys_meta.max, name) == 4)
-                {
-                    cell.type = cell_t::SYS_META;
-                    cell.name = name;
-                }
-                else if (sscanf(cstr, "%d:location::%31s", &index, name) == 2)
-                {
-                    cell.type = cell_t::LOCATION;
-                    cell.location.flags = cell_t::NONE;
-                    cell.name = name;
-                }
-                else if (sscanf(cstr, "%d:location:committed:%31s", &index, name) == 2)
-                {
-                    cell.type = cell_t::LOCATION;
-                    cell.location.flags = cell_t::COMMITTED;
-                    cell.name = name;
-                }
-                else if (sscanf(cstr, "%d:location:urgent:%31s", &index, name) == 2)
-                {
-                    cell.type = cell_t::LOCATION;
-                    cell.location.flags = cell_t::URGENT;
-                    cell.name = name;
-                }
-                else if (sscanf(cstr, "%d:static:%d:%d:%31s", &index,
-                    &cell.fixed.min, &cell.fixed.max,
-                    name) == 4)
-                {
-                    cell.type = cell_t::FIXED;
-                    cell.name = name;
-                }
-                else if (sscanf(cstr, "%d:%5s", &index, s) == 2
-                    && strcmp(s, "cost") == 0)
-                {
-                    cell.type = cell_t::COST;
-                }
-                else
-                {
-                    throw invalid_format(str);
-                }
-
-                layout.push_back(cell);
-            }
-#if defined(ENABLE_CORA) || defined(ENABLE_PRICED)
-            cell.type = cell_t::VAR;
-            cell.var.min = std::numeric_limits<int32_t>::min();
-            cell.var.max = std::numeric_limits<int32_t>::max();
-            cell.var.init = 0;
-
-            cell.name = "infimum_cost";
-            cell.var.nr = variableCount++;
-            variables.push_back(cell.name);
-            layout.push_back(cell);
-
-            cell.name = "offset_cost";
-            cell.var.nr = variableCount++;
-            variables.push_back(cell.name);
-            layout.push_back(cell);
+        return;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(fileHandle, &size))
+    {
+        return;
+    }
+    opened = true;
+    length = static_cast<size_t>(size.QuadPart);
+    if (length == 0)
+    {
+        return;
+    }
+    mapHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapHandle != nullptr)
+    {
+        data = static_cast<const char*>(MapViewOfFile(mapHandle, FILE_MAP_READ, 0, 0, 0));
+    }
+    if (data == nullptr)
+    {
+        opened = false;
+        length = 0;
+    }
+}
 
-            for (size_t i = 1; i < clocks.size(); ++i) {
-                cell.name = "#rate[";
-                cell.name.append(clocks[i]);
-                cell.name.append("]");
-                cell.var.nr = variableCount++;
-                variables.push_back(cell.name);
-                layout.push_back(cell);
-            }
-#endif
-        }
-        else if (section == "instructions")
+mapped_file::~mapped_file()
+{
+    if (data != nullptr)
+    {
+        UnmapViewOfFile(data);
+    }
+    if (mapHandle != nullptr)
+    {
+        CloseHandle(mapHandle);
+    }
+    if (fileHandle != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(fileHandle);
+    }
+}
+#else
+mapped_file::mapped_file(const string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        opened = true;
+        length = static_cast<size_t>(st.st_size);
+        if (length > 0)
         {
-            while (read(file, str) && !str.empty() && (!isspace(str[0]) || str[0] == '\t'))
+            void* addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED)
             {
-                int address;
-                int values[4];
-                if (str[0] == '\t')
-                {   // skip pretty-printed instruction text
-                    continue;
-                }
-                int cnt = sscanf(str.c_str(), "%d:%d%d%d%d", &address,
-                    &values[0], &values[1], &values[2], &values[3]);
-                if (cnt < 2)
-                {
-                    throw invalid_format("In instruction section");
-                }
-
-                for (int i = 0; i < cnt - 1; ++i)
-                {
-                    instructions.push_back(values[i]);
-                }
+                opened = false;
+                length = 0;
             }
-        }
-        else if (section == "processes")
-        {
-            while (read(file, str) && !str.empty() && !isspace(str[0]))
+            else
             {
-                process_t process;
-                if (sscanf(str.c_str(), "%d:%d:%31s",
-                    &index, &process.initial, name) != 3)
-                {
-                    throw invalid_format("In process section");
-                }
-                process.name = name;
-                processes.push_back(process);
-                processCount++;
+                madvise(addr, length, MADV_SEQUENTIAL);
+                data = static_cast<const char*>(addr);
+            }
+        }
+    }
+    close(fd);
+}
+
+mapped_file::~mapped_file()
+{
+    if (data != nullptr)
+    {
+        munmap(const_cast<char*>(data), length);
+    }
+}
+#endif
+
+/* Returns true if path names a regular file. Standard input ("-"),
+ * pipes and FIFOs can only be read once and from the front, so they
+ * are neither mapped, peeked at nor hashed.
+ */
+bool isRegularFile(const string& path)
+{
+    if (path == "-")
+    {
+        return false;
+    }
+#ifdef _WIN32
+    DWORD attributes = GetFileAttributesA(path.c_str());
+    return attributes != INVALID_FILE_ATTRIBUTES && !(attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode);
+#endif
+}
+
+/* Returns true if path can be opened for reading without reading from
+ * it, unlike opening an ifstream this does not block on a FIFO.
+ */
+bool isReadable(const string& path)
+{
+    if (path == "-")
+    {
+        return true;
+    }
+#ifdef _WIN32
+    return GetFileAttributesA(path.c_str()) != INVALID_FILE_ATTRIBUTES;
+#else
+    return access(path.c_str(), R_OK) == 0;
+#endif
+}
+
+/* Compression formats recognised by their magic bytes.
+ */
+enum compression_t { COMPRESSION_NONE, COMPRESSION_GZIP, COMPRESSION_ZSTD };
+
+compression_t detectCompression(const string& path)
+{
+    //Reading the magic bytes of a pipe would consume them.
+    if (!isRegularFile(path))
+    {
+        return COMPRESSION_NONE;
+    }
+
+    unsigned char magic[4] = { 0, 0, 0, 0 };
+    ifstream file(path, std::ios::binary);
+    file.read(reinterpret_cast<char*>(magic), sizeof(magic));
+
+    if (file.gcount() >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+    {
+        return COMPRESSION_GZIP;
+    }
+    if (file.gcount() == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+    {
+        return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+}
+
+/* A stream buffer that decompresses a gzip or zstd file while it is
+ * read, so the decompressed data never has to be written to disk.
+ */
+class decompressing_buffer : public std::streambuf
+{
+public:
+    decompressing_buffer(const string& path, compression_t compression);
+    decompressing_buffer(const decompressing_buffer&) = delete;
+    decompressing_buffer& operator=(const decompressing_buffer&) = delete;
+    ~decompressing_buffer();
+protected:
+    int_type underflow() override;
+private:
+    static const size_t bufferSize = 1 << 16;
+
+    bool fill();
+
+    ifstream source;
+    compression_t compression;
+    vector<char> in;
+    vector<char> out;
+    size_t inPos = 0;
+    size_t inSize = 0;
+    bool outputFull = false;
+    bool finished = false;
+#ifdef ENABLE_ZLIB
+    z_stream zlib{};
+#endif
+#ifdef ENABLE_ZSTD
+    ZSTD_DStream* zstd = nullptr;
+#endif
+};
+
+decompressing_buffer::decompressing_buffer(const string& path, compression_t compression)
+    : source(path, std::ios::binary), compression(compression), in(bufferSize), out(bufferSize)
+{
+    switch (compression)
+    {
+    case COMPRESSION_GZIP:
+#ifdef ENABLE_ZLIB
+        //15 + 32: any window size, gzip or zlib header detected automatically.
+        if (inflateInit2(&zlib, 15 + 32) != Z_OK)
+        {
+            throw invalid_format("Cannot initialise zlib for " + path);
+        }
+        break;
+#else
+        throw invalid_format(path + " is gzip compressed. Build with -DENABLE_ZLIB and -lz to read it.");
+#endif
+    case COMPRESSION_ZSTD:
+#ifdef ENABLE_ZSTD
+        zstd = ZSTD_createDStream();
+        if (zstd == nullptr || ZSTD_isError(ZSTD_initDStream(zstd)))
+        {
+            throw invalid_format("Cannot initialise zstd for " + path);
+        }
+        break;
+#else
+        throw invalid_format(path + " is zstd compressed. Build with -DENABLE_ZSTD and -lzstd to read it.");
+#endif
+    default:
+        throw invalid_format(path + " is not compressed");
+    }
+    setg(out.data(), out.data(), out.data());
+}
+
+decompressing_buffer::~decompressing_buffer()
+{
+#ifdef ENABLE_ZLIB
+    if (compression == COMPRESSION_GZIP)
+    {
+        inflateEnd(&zlib);
+    }
+#endif
+#ifdef ENABLE_ZSTD
+    ZSTD_freeDStream(zstd);
+#endif
+}
+
+decompressing_buffer::int_type decompressing_buffer::underflow()
+{
+    if (gptr() < egptr())
+    {
+        return traits_type::to_int_type(*gptr());
+    }
+    while (!finished)
+    {
+        if (fill())
+        {
+            return traits_type::to_int_type(*gptr());
+        }
+    }
+    return traits_type::eof();
+}
+
+/* Decompresses the next piece of the file into out. Returns false if
+ * nothing was produced, which is not an error as long as finished is
+ * not set.
+ */
+bool decompressing_buffer::fill()
+{
+    //A full output buffer may leave decompressed data behind, which is fetched before reading on.
+    if (inPos == inSize && !outputFull)
+    {
+        source.read(in.data(), in.size());
+        inSize = static_cast<size_t>(source.gcount());
+        inPos = 0;
+        if (inSize == 0)
+        {
+            finished = true;
+            return false;
+        }
+    }
+
+    size_t produced = 0;
+#ifdef ENABLE_ZLIB
+    if (compression == COMPRESSION_GZIP)
+    {
+        zlib.next_in = reinterpret_cast<Bytef*>(in.data() + inPos);
+        zlib.avail_in = static_cast<uInt>(inSize - inPos);
+        zlib.next_out = reinterpret_cast<Bytef*>(out.data());
+        zlib.avail_out = static_cast<uInt>(out.size());
+        int status = inflate(&zlib, Z_NO_FLUSH);
+        if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+        {
+            throw invalid_format("Corrupt gzip data");
+        }
+        inPos = inSize - zlib.avail_in;
+        produced = out.size() - zlib.avail_out;
+        if (status == Z_STREAM_END)
+        {
+            //Concatenated gzip members are read as one stream.
+            inflateReset(&zlib);
+        }
+    }
+#endif
+#ifdef ENABLE_ZSTD
+    if (compression == COMPRESSION_ZSTD)
+    {
+        ZSTD_inBuffer input = { in.data(), inSize, inPos };
+        ZSTD_outBuffer output = { out.data(), out.size(), 0 };
+        size_t status = ZSTD_decompressStream(zstd, &output, &input);
+        if (ZSTD_isError(status))
+        {
+            throw invalid_format(string("Corrupt zstd data: ") + ZSTD_getErrorName(status));
+        }
+        inPos = input.pos;
+        produced = output.pos;
+    }
+#endif
+    outputFull = (produced == out.size());
+    setg(out.data(), out.data(), out.data() + produced);
+    return produced > 0;
+}
+
+/* An input stream over a file that may be gzip or zstd compressed.
+ */
+class input_file : public std::istream
+{
+public:
+    explicit input_file(const string& path) : std::istream(nullptr)
+    {
+        if (path == "-")
+        {
+            rdbuf(cin.rdbuf());
+            return;
+        }
+
+        compression_t compression = detectCompression(path);
+        if (compression == COMPRESSION_NONE)
+        {
+            auto file = std::make_unique<std::filebuf>();
+            if (file->open(path, std::ios::in))
+            {
+                buffer = std::move(file);
+            }
+        }
+        else
+        {
+            buffer = std::make_unique<decompressing_buffer>(path, compression);
+        }
+        rdbuf(buffer.get());
+        if (!buffer)
+        {
+            setstate(std::ios::failbit);
+        }
+    }
+private:
+    std::unique_ptr<std::streambuf> buffer;
+};
+
+/* A position in an in-memory XTR trace. The trace is never copied;
+ * all parsing functions below advance the cursor in place.
+ */
+struct trace_cursor
+{
+    const char* pos;
+    const char* end;
+};
+
+inline
+void skipspaces(trace_cursor& c)
+{
+    while (c.pos != c.end && *c.pos == ' ')
+    {
+        c.pos++;
+    }
+}
+
+/* Skips white space. Everything at or below ' ' counts as white
+ * space, which keeps the loop down to a single compare per byte.
+ */
+inline
+void skipwhitespace(trace_cursor& c)
+{
+    while (c.pos != c.end && static_cast<unsigned char>(*c.pos) <= ' ')
+    {
+        c.pos++;
+    }
+}
+
+/* Tokens of the numeric blocks of an XTR trace.
+ */
+enum xtr_token_t { XTR_INT, XTR_DOT, XTR_OTHER };
+
+inline
+int countTrailingZeros(uint64_t x)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, x);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
+/* Parses the decimal digits starting at p and returns the position
+ * after the last digit. Eight bytes are classified and converted at a
+ * time (SWAR) while at least eight bytes are left, the tail of the
+ * trace is handled one byte at a time. Assumes a little endian host.
+ * A result above digitLimit is kept at digitLimit + 1, so any number
+ * too large for an int is seen as such however many digits it has.
+ */
+const uint64_t digitLimit = uint64_t(1) << 31;
+
+inline
+const char* parseDigits(const char* p, const char* end, uint64_t& result)
+{
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t high = 0xF0F0F0F0F0F0F0F0ULL;
+
+    result = 0;
+    while (end - p >= 8)
+    {
+        uint64_t chunk;
+        memcpy(&chunk, p, sizeof(chunk));
+
+        /* A byte is a digit iff its high nibble is 3 both before and
+         * after adding 6. Any carry out of a byte comes from a non-digit
+         * and therefore only affects bytes after the first non-digit. */
+        uint64_t nondigit = ((chunk & high) ^ (0x30 * ones))
+            | (((chunk + 0x06 * ones) & high) ^ (0x30 * ones));
+        int count = nondigit == 0 ? 8 : countTrailingZeros(nondigit) / 8;
+        if (count == 0)
+        {
+            return p;
+        }
+
+        /* Shift out the non-digits; the zero bytes shifted in act as
+         * leading zeros. Then combine 2, 4 and 8 digits at a time. */
+        uint64_t v = (chunk & (0x0F * ones)) << (8 * (8 - count));
+        v = (v * 10 + (v >> 8)) & 0x00FF00FF00FF00FFULL;
+        v = (v * 100 + (v >> 16)) & 0x0000FFFF0000FFFFULL;
+        v = (v * 10000 + (v >> 32)) & 0x00000000FFFFFFFFULL;
+
+        static const uint32_t scale[9] = { 1, 10, 100, 1000, 10000, 100000,
+            1000000, 10000000, 100000000 };
+        result = std::min(result * scale[count] + v, digitLimit + 1);
+        p += count;
+        if (count < 8)
+        {
+            return p;
+        }
+    }
+    while (p != end && static_cast<unsigned char>(*p - '0') < 10)
+    {
+        result = std::min(result * 10 + (*p - '0'), digitLimit + 1);
+        p++;
+    }
+    return p;
+}
+
+/* Reports that the line at start is not what was expected.
+ */
+[[noreturn]] void formaterror(trace_cursor& c, const char* start, const char* expected)
+{
+    c.pos = start;
+    skipwhitespace(c);
+    const char* eol = c.pos;
+    while (eol != c.end && *eol != '\n')
+    {
+        eol++;
+    }
+    throw invalid_format(string("Expecting ") + expected + " but got '" + string(c.pos, eol) + "'");
+}
+
+/* Reads the next token of a numeric block: a signed decimal integer
+ * or a terminating dot. A dot consumes the rest of its line. Anything
+ * else is left unconsumed apart from the leading white space. An
+ * integer that does not fit in an int is a format error, as it is
+ * for the istream reader.
+ */
+inline
+xtr_token_t nexttoken(trace_cursor& c, int& value)
+{
+    skipwhitespace(c);
+    const char* p = c.pos;
+    if (p == c.end)
+    {
+        return XTR_OTHER;
+    }
+    if (*p == '.')
+    {
+        const void* eol = memchr(p, '\n', c.end - p);
+        c.pos = eol ? static_cast<const char*>(eol) : c.end;
+        return XTR_DOT;
+    }
+    bool negative = (*p == '-');
+    p += (*p == '-' || *p == '+');
+    if (p == c.end || static_cast<unsigned char>(*p - '0') >= 10)
+    {
+        return XTR_OTHER;
+    }
+    uint64_t result;
+    const char* start = c.pos;
+    c.pos = parseDigits(p, c.end, result);
+    if (result > (negative ? digitLimit : digitLimit - 1))
+    {
+        formaterror(c, start, "an integer that fits in an int");
+    }
+    value = static_cast<int>(negative ? -static_cast<int64_t>(result) : static_cast<int64_t>(result));
+    return XTR_INT;
+}
+
+/* Reads a signed decimal integer. Returns false without consuming
+ * anything but leading white space if there is no integer.
+ */
+inline
+bool readint(trace_cursor& c, int& value)
+{
+    skipwhitespace(c);
+    if (c.pos != c.end && *c.pos == '.')
+    {
+        return false;
+    }
+    return nexttoken(c, value) == XTR_INT;
+}
+
+/* Asserts that the next token is a (terminating) dot and skips the
+ * rest of its line.
+ */
+void readdot(trace_cursor& c)
+{
+    int value;
+    const char* start = c.pos;
+    if (nexttoken(c, value) != XTR_DOT)
+    {
+        formaterror(c, start, "a line with '.'");
+    }
+}
+
+/* Asserts that the next token is an integer and reads it.
+ */
+void readint(trace_cursor& c, int& value, const char* expected)
+{
+    const char* start = c.pos;
+    if (!readint(c, value))
+    {
+        formaterror(c, start, expected);
+    }
+}
+
+/* Skips the zone of a state without decoding it. The numbers of the
+ * zone never contain a dot, so the zone ends at the first dot with
+ * nothing but white space between it and the dot before it, which is
+ * found with memchr instead of reading the numbers. The text skipped
+ * is still checked to hold nothing but numbers.
+ */
+void skipDBM(trace_cursor& c)
+{
+    for (;;)
+    {
+        const void* found = memchr(c.pos, '.', c.end - c.pos);
+        if (found == nullptr)
+        {
+            c.pos = c.end;
+            readdot(c);
+            return;
+        }
+        const char* dot = static_cast<const char*>(found);
+        bool blank = true;
+        for (const char* p = c.pos; p != dot; p++)
+        {
+            unsigned char ch = *p;
+            if (ch <= ' ')
+            {
+                continue;
+            }
+            if (static_cast<unsigned char>(ch - '0') >= 10 && ch != '-' && ch != '+')
+            {
+                formaterror(c, p, "a constraint");
+            }
+            blank = false;
+        }
+        c.pos = dot + 1;
+        if (blank)
+        {
+            return;
+        }
+    }
+}
+
+/* Reads an integer field of a line of the intermediate file and the
+ * ':' that ends it.
+ */
+bool readIFInt(const char*& p, int& value)
+{
+    char* next;
+    long v = strtol(p, &next, 10);
+    if (next == p || *next != ':')
+    {
+        return false;
+    }
+    value = static_cast<int>(v);
+    p = next + 1;
+    return true;
+}
+
+/* Reads a field of a line of the intermediate file up to the next ':'
+ * or the end of the line. The ':' is skipped.
+ */
+string readIFToken(const char*& p)
+{
+    const char* start = p;
+    while (*p != '\0' && *p != ':' && !isspace(static_cast<unsigned char>(*p)))
+    {
+        p++;
+    }
+    string token(start, p);
+    if (*p == ':')
+    {
+        p++;
+    }
+    return token;
+}
+
+/* Reads the name that ends a line of the intermediate file. Names are
+ * not limited in length.
+ */
+bool readIFName(const char* p, string& name)
+{
+    const char* start = p;
+    while (*p != '\0' && !isspace(static_cast<unsigned char>(*p)))
+    {
+        p++;
+    }
+    name.assign(start, p);
+    return !name.empty();
+}
+
+/* Parses a line of the layout section. The index is read first and
+ * the kind that follows it selects the fields that are read next, so
+ * each line is scanned once.
+ */
+void parseLayoutCell(const string& str, cell_t& cell)
+{
+    const char* p = str.c_str();
+    int index;
+
+    if (!readIFInt(p, index))
+    {
+        throw invalid_format(str);
+    }
+
+    string kind = readIFToken(p);
+    bool ok;
+
+    if (kind == "clock")
+    {
+        ok = readIFInt(p, cell.clock.nr) && readIFName(p, cell.name);
+        cell.type = cell_t::CLOCK;
+        if (ok)
+        {
+            clocks.push_back(cell.name);
+            clockCount++;
+        }
+    }
+    else if (kind == "const")
+    {
+        char* next;
+        cell.value = static_cast<int>(strtol(p, &next, 10));
+        ok = next != p;
+        cell.type = cell_t::CONST;
+    }
+    else if (kind == "var" || kind == "meta")
+    {
+        //var and meta cells share the same fields.
+        ok = readIFInt(p, cell.var.min) && readIFInt(p, cell.var.max)
+            && readIFInt(p, cell.var.init) && readIFInt(p, cell.var.nr)
+            && readIFName(p, cell.name);
+        cell.type = kind == "var" ? cell_t::VAR : cell_t::META;
+        if (ok)
+        {
+            variables.push_back(cell.name);
+            variableCount++;
+        }
+    }
+    else if (kind == "sys_meta")
+    {
+        ok = readIFInt(p, cell.sys_meta.min) && readIFInt(p, cell.sys_meta.max)
+            && readIFName(p, cell.name);
+        cell.type = cell_t::SYS_META;
+    }
+    else if (kind == "location")
+    {
+        string flags = readIFToken(p);
+        ok = readIFName(p, cell.name);
+        cell.type = cell_t::LOCATION;
+        if (flags.empty())
+        {
+            cell.location.flags = cell_t::NONE;
+        }
+        else if (flags == "committed")
+        {
+            cell.location.flags = cell_t::COMMITTED;
+        }
+        else if (flags == "urgent")
+        {
+            cell.location.flags = cell_t::URGENT;
+        }
+        else
+        {
+            ok = false;
+        }
+    }
+    else if (kind == "static")
+    {
+        ok = readIFInt(p, cell.fixed.min) && readIFInt(p, cell.fixed.max)
+            && readIFName(p, cell.name);
+        cell.type = cell_t::FIXED;
+    }
+    else if (kind == "cost")
+    {
+        ok = true;
+        cell.type = cell_t::COST;
+    }
+    else
+    {
+        ok = false;
+    }
+
+    if (!ok)
+    {
+        throw invalid_format(str);
+    }
+}
+
+/* Parser for intermediate format.
+ */
+void loadIF(istream& file)
+{
+    string str;
+    string section;
+    int index;
+
+    while (getline(file, section))
+    {
+        if (section == "layout")
+        {
+            cell_t cell;
+            while (read(file, str) && !str.empty() && !isspace(str[0]))
+            {
+                parseLayoutCell(str, cell);
+                layout.push_back(cell);
+            }
+#if defined(ENABLE_CORA) || defined(ENABLE_PRICED)
+            cell.type = cell_t::VAR;
+            cell.var.min = std::numeric_limits<int32_t>::min();
+            cell.var.max = std::numeric_limits<int32_t>::max();
+            cell.var.init = 0;
+
+            cell.name = "infimum_cost";
+            cell.var.nr = variableCount++;
+            variables.push_back(cell.name);
+            layout.push_back(cell);
+
+            cell.name = "offset_cost";
+            cell.var.nr = variableCount++;
+            variables.push_back(cell.name);
+            layout.push_back(cell);
+
+            for (size_t i = 1; i < clocks.size(); ++i) {
+                cell.name = "#rate[";
+                cell.name.append(clocks[i]);
+                cell.name.append("]");
+                cell.var.nr = variableCount++;
+                variables.push_back(cell.name);
+                layout.push_back(cell);
+            }
+#endif
+        }
+        else if (section == "instructions")
+        {
+            while (read(file, str) && !str.empty() && (!isspace(str[0]) || str[0] == '\t'))
+            {
+                int address;
+                int values[4];
+                if (str[0] == '\t')
+                {   // skip pretty-printed instruction text
+                    continue;
+                }
+                int cnt = sscanf(str.c_str(), "%d:%d%d%d%d", &address,
+                    &values[0], &values[1], &values[2], &values[3]);
+                if (cnt < 2)
+                {
+                    throw invalid_format("In instruction section");
+                }
+
+                for (int i = 0; i < cnt - 1; ++i)
+                {
+                    instructions.push_back(values[i]);
+                }
+            }
+        }
+        else if (section == "processes")
+        {
+            while (read(file, str) && !str.empty() && !isspace(str[0]))
+            {
+                process_t process;
+                const char* p = str.c_str();
+                if (!readIFInt(p, index) || !readIFInt(p, process.initial)
+                    || !readIFName(p, process.name))
+                {
+                    throw invalid_format("In process section");
+                }
+                processes.push_back(process);
+                processCount++;
             }
         }
         else if (section == "locations")
         {
-            while (read(file, str) && !str.empty() && !isspace(str[0]))
+            while (read(file, str) && !str.empty() && !isspace(str[0]))
+            {
+                int index;
+                int process;
+                int invariant;
+
+                if (sscanf(str.c_str(), "%d:%d:%d", &index, &process, &invariant) != 3)
+                {
+                    throw invalid_format("In location section");
+                }
+
+                layout[index].location.process = process;
+                layout[index].location.invariant = invariant;
+                processes[process].locations.push_back(index);
+            }
+        }
+        else if (section == "edges")
+        {
+            while (read(file, str) && !str.empty() && !isspace(str[0]))
+            {
+                edge_t edge;
+
+                if (sscanf(str.c_str(), "%d:%d:%d:%d:%d:%d", &edge.process,
+                    &edge.source, &edge.target,
+                    &edge.guard, &edge.sync, &edge.update) != 6)
+                {
+                    throw invalid_format("In edge section");
+                }
+
+                processes[edge.process].edges.push_back(edges.size());
+                edges.push_back(edge);
+            }
+        }
+        else if (section == "expressions")
+        {
+            while (read(file, str) && !str.empty() && !isspace(str[0]))
+            {
+                if (sscanf(str.c_str(), "%d", &index) != 1)
+                {
+                    throw invalid_format("In expression section");
+                }
+
+                /* Find expression string (after the third colon). */
+                auto* s = str.c_str();
+                int cnt = 3;
+                while (cnt && *s)
+                {
+                    cnt -= (*s == ':');
+                    s++;
+                }
+                if (cnt)
+                {
+                    throw invalid_format("In expression section");
+                }
+
+                /* Trim white space. */
+                while (*s && isspace(*s))
+                {
+                    s++;
+                }
+                auto* t = s + strlen(s) - 1;
+                while (t >= s && isspace(*t))
+                {
+                    t--;
+                }
+
+                if (index < 0)
+                {
+                    throw invalid_format("In expression section");
+                }
+                if (static_cast<size_t>(index) >= expressions.size())
+                {
+                    expressions.resize(index + 1);
+                }
+                expressions[index].assign(s, t + 1);
+            }
+        }
+        else
+        {
+            throw invalid_format("Unknown section");
+        }
+    }
+};
+
+/* Binary snapshots of the tables filled by loadIF. A snapshot starts
+ * with a magic string, the format version and a hash of the
+ * intermediate file it was made from; it is only used if the hash
+ * matches the current intermediate file.
+ */
+static const char snapshotMagic[8] = { 'T', 'R', 'I', 'F', 'S', 'N', 'A', 'P' };
+static const uint32_t snapshotVersion = 2;
+
+/* 64 bit FNV-1a hash.
+ */
+uint64_t hashBytes(const char* data, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+struct snapshot_writer
+{
+    string buffer;
+
+    template<class T>
+    void put(const T& value)
+    {
+        buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    void put(const string& str)
+    {
+        put<uint64_t>(str.size());
+        buffer.append(str);
+    }
+
+    template<class T>
+    void put(const vector<T>& values)
+    {
+        put<uint64_t>(values.size());
+        for (auto& value : values)
+        {
+            put(value);
+        }
+    }
+};
+
+struct snapshot_reader
+{
+    const char* pos;
+    const char* end;
+
+    template<class T>
+    bool get(T& value)
+    {
+        if (static_cast<size_t>(end - pos) < sizeof(value))
+        {
+            return false;
+        }
+        memcpy(&value, pos, sizeof(value));
+        pos += sizeof(value);
+        return true;
+    }
+
+    bool get(string& str)
+    {
+        uint64_t size;
+        if (!get(size) || static_cast<uint64_t>(end - pos) < size)
+        {
+            return false;
+        }
+        str.assign(pos, size);
+        pos += size;
+        return true;
+    }
+
+    template<class T>
+    bool get(vector<T>& values)
+    {
+        uint64_t size;
+        if (!get(size) || static_cast<uint64_t>(end - pos) < size)
+        {
+            return false;
+        }
+        values.resize(size);
+        for (auto& value : values)
+        {
+            if (!get(value))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+/* The union part of a cell is stored as raw bytes. var is its largest member.
+ */
+static const size_t cellDataSize = sizeof(cell_t::var);
+static_assert(sizeof(cell_t::location) <= cellDataSize, "cell_t::var must be the largest member");
+
+void putCell(snapshot_writer& out, const cell_t& cell)
+{
+    out.put(cell.type);
+    out.put(cell.name);
+    out.buffer.append(reinterpret_cast<const char*>(&cell.var), cellDataSize);
+}
+
+bool getCell(snapshot_reader& in, cell_t& cell)
+{
+    if (!in.get(cell.type) || !in.get(cell.name) || static_cast<size_t>(in.end - in.pos) < cellDataSize)
+    {
+        return false;
+    }
+    memcpy(&cell.var, in.pos, cellDataSize);
+    in.pos += cellDataSize;
+    return true;
+}
+
+void saveIFSnapshot(const string& path, uint64_t hash)
+{
+    snapshot_writer out;
+    out.buffer.append(snapshotMagic, sizeof(snapshotMagic));
+    out.put(snapshotVersion);
+    out.put(hash);
+
+    out.put<uint64_t>(layout.size());
+    for (auto& cell : layout)
+    {
+        putCell(out, cell);
+    }
+    out.put(instructions);
+    out.put<uint64_t>(processes.size());
+    for (auto& process : processes)
+    {
+        out.put(process.initial);
+        out.put(process.name);
+        out.put(process.locations);
+        out.put(process.edges);
+    }
+    out.put(edges);
+    out.put(expressions);
+    out.put(clocks);
+    out.put(variables);
+    out.put<uint64_t>(processCount);
+    out.put<uint64_t>(variableCount);
+    out.put<uint64_t>(clockCount);
+
+    //Other conversions may have the snapshot mapped, so it is replaced as a whole, never rewritten in place.
+#ifdef _WIN32
+    string temporary = path + ".tmp" + to_string(GetCurrentProcessId());
+#else
+    string temporary = path + ".tmp" + to_string(getpid());
+#endif
+    {
+        ofstream file(temporary, std::ios::binary);
+        file.write(out.buffer.data(), out.buffer.size());
+        if (!file.flush())
+        {
+            file.close();
+            std::remove(temporary.c_str());
+            return;
+        }
+    }
+#ifdef _WIN32
+    bool replaced = MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    bool replaced = std::rename(temporary.c_str(), path.c_str()) == 0;
+#endif
+    if (!replaced)
+    {
+        std::remove(temporary.c_str());
+    }
+}
+
+/* Loads the tables from a snapshot. Returns false and leaves the tables
+ * untouched if there is no usable snapshot for the given hash.
+ */
+bool loadIFSnapshot(const string& path, uint64_t hash)
+{
+    mapped_file file(path);
+    if (!file.is_open())
+    {
+        return false;
+    }
+    snapshot_reader in{ file.begin(), file.end() };
+
+    char magic[sizeof(snapshotMagic)];
+    uint32_t version;
+    uint64_t snapshotHash;
+    if (!in.get(magic) || memcmp(magic, snapshotMagic, sizeof(magic)) != 0
+        || !in.get(version) || version != snapshotVersion
+        || !in.get(snapshotHash) || snapshotHash != hash)
+    {
+        return false;
+    }
+
+    vector<cell_t> newLayout;
+    vector<int> newInstructions;
+    vector<process_t> newProcesses;
+    vector<edge_t> newEdges;
+    vector<string> newExpressions;
+    vector<string> newClocks;
+    vector<string> newVariables;
+    uint64_t count, newProcessCount, newVariableCount, newClockCount;
+
+    if (!in.get(count) || count > static_cast<uint64_t>(in.end - in.pos))
+    {
+        return false;
+    }
+    newLayout.resize(count);
+    for (auto& cell : newLayout)
+    {
+        if (!getCell(in, cell))
+        {
+            return false;
+        }
+    }
+    if (!in.get(newInstructions) || !in.get(count) || count > static_cast<uint64_t>(in.end - in.pos))
+    {
+        return false;
+    }
+    newProcesses.resize(count);
+    for (auto& process : newProcesses)
+    {
+        if (!in.get(process.initial) || !in.get(process.name)
+            || !in.get(process.locations) || !in.get(process.edges))
+        {
+            return false;
+        }
+    }
+    if (!in.get(newEdges) || !in.get(newExpressions))
+    {
+        return false;
+    }
+    if (!in.get(newClocks) || !in.get(newVariables)
+        || !in.get(newProcessCount) || !in.get(newVariableCount) || !in.get(newClockCount))
+    {
+        return false;
+    }
+
+    layout.swap(newLayout);
+    instructions.swap(newInstructions);
+    processes.swap(newProcesses);
+    edges.swap(newEdges);
+    expressions.swap(newExpressions);
+    clocks.swap(newClocks);
+    variables.swap(newVariables);
+    processCount = newProcessCount;
+    variableCount = newVariableCount;
+    clockCount = newClockCount;
+    return true;
+}
+
+/* Loads an intermediate file through its snapshot, which is kept next
+ * to it with the extension .snapshot. The snapshot is (re)written if it
+ * is missing or was made from a different intermediate file.
+ */
+void loadIFCached(const string& ifFile)
+{
+    //A piped intermediate file has no place to keep a snapshot.
+    if (!isRegularFile(ifFile))
+    {
+        input_file file(ifFile);
+        loadIF(file);
+        return;
+    }
+
+    uint64_t hash;
+    {
+        mapped_file source(ifFile);
+        hash = hashBytes(source.begin(), source.end() - source.begin());
+    }
+
+    string snapshotFile = ifFile + ".snapshot";
+    if (loadIFSnapshot(snapshotFile, hash))
+    {
+        return;
+    }
+
+    input_file file(ifFile);
+    loadIF(file);
+    saveIFSnapshot(snapshotFile, hash);
+}
+
+#ifdef ENABLE_LIBUTAP
+/* Evaluates a constant integer expression of the model, e.g. an array
+ * size or an initialiser. Identifiers are resolved through the
+ * arguments of instance and the initialisers of constants. Returns
+ * false if the expression is not constant.
+ */
+bool evaluateConstant(const UTAP::expression_t& expr, const UTAP::instance_t* instance, int& value)
+{
+    using namespace UTAP::Constants;
+
+    if (expr.empty())
+    {
+        return false;
+    }
+
+    int left, right;
+    switch (expr.getKind())
+    {
+    case CONSTANT:
+        value = expr.getValue();
+        return true;
+    case IDENTIFIER:
+    {
+        const UTAP::symbol_t symbol = expr.getSymbol();
+        if (instance != nullptr)
+        {
+            auto argument = instance->mapping.find(symbol);
+            if (argument != instance->mapping.end())
+            {
+                return evaluateConstant(argument->second, nullptr, value);
+            }
+        }
+        auto* variable = static_cast<const UTAP::variable_t*>(symbol.getData());
+        return symbol.getType().isConstant() && variable != nullptr
+            && evaluateConstant(variable->expr, instance, value);
+    }
+    case UNARY_MINUS:
+        if (!evaluateConstant(expr[0], instance, left))
+        {
+            return false;
+        }
+        value = -left;
+        return true;
+    case PLUS:
+    case MINUS:
+    case MULT:
+    case DIV:
+    case MOD:
+        if (!evaluateConstant(expr[0], instance, left) || !evaluateConstant(expr[1], instance, right))
+        {
+            return false;
+        }
+        switch (expr.getKind())
+        {
+        case PLUS: value = left + right; return true;
+        case MINUS: value = left - right; return true;
+        case MULT: value = left * right; return true;
+        default:
+            if (right == 0)
+            {
+                return false;
+            }
+            value = expr.getKind() == DIV ? left / right : left % right;
+            return true;
+        }
+    default:
+        return false;
+    }
+}
+
+/* Adds the cells of one declared variable to the layout. Arrays and
+ * records are flattened into one cell per element, named the way
+ * verifyta names them, e.g. agents[0].a_position.
+ */
+void addModelVariable(const UTAP::type_t& type, const string& name, const UTAP::expression_t& init, const UTAP::instance_t* instance)
+{
+    if (type.isConstant() || type.isChannel() || type.isFunction() || type.isDouble() || type.isVoid())
+    {
+        return;
+    }
+
+    if (type.isArray())
+    {
+        auto range = type.getArraySize().getRange();
+        int lower, upper;
+        if (!evaluateConstant(range.first, instance, lower) || !evaluateConstant(range.second, instance, upper))
+        {
+            throw invalid_format("Cannot evaluate the size of " + name);
+        }
+        bool list = !init.empty() && init.getKind() == UTAP::Constants::LIST;
+        for (int i = 0; i <= upper - lower; i++)
+        {
+            addModelVariable(type.getSub(), name + "[" + to_string(i) + "]",
+                list && i < init.getSize() ? init[i] : UTAP::expression_t(), instance);
+        }
+        return;
+    }
+
+    if (type.isRecord())
+    {
+        bool list = !init.empty() && init.getKind() == UTAP::Constants::LIST;
+        for (size_t i = 0; i < type.getRecordSize(); i++)
+        {
+            addModelVariable(type.getSub(i), name + "." + type.getRecordLabel(i),
+                list && i < init.getSize() ? init[i] : UTAP::expression_t(), instance);
+        }
+        return;
+    }
+
+    cell_t cell;
+    cell.name = name;
+    if (type.isClock())
+    {
+        cell.type = cell_t::CLOCK;
+        cell.clock.nr = clockCount++;
+        clocks.push_back(name);
+    }
+    else if (type.isIntegral())
+    {
+        cell.type = cell_t::VAR;
+        cell.var.min = std::numeric_limits<int32_t>::min();
+        cell.var.max = std::numeric_limits<int32_t>::max();
+        if (type.isBoolean())
+        {
+            cell.var.min = 0;
+            cell.var.max = 1;
+        }
+        else if (type.isRange())
+        {
+            auto range = type.getRange();
+            evaluateConstant(range.first, instance, cell.var.min);
+            evaluateConstant(range.second, instance, cell.var.max);
+        }
+        cell.var.init = 0;
+        evaluateConstant(init, instance, cell.var.init);
+        cell.var.nr = variableCount++;
+        variables.push_back(name);
+    }
+    else
+    {
+        return;
+    }
+    layout.push_back(cell);
+}
+
+/* Adds an expression to the expression table and returns its index.
+ */
+int addModelExpression(const UTAP::expression_t& expr)
+{
+    int index = expressions.size();
+    expressions.push_back(expr.empty() ? string() : expr.toString());
+    return index;
+}
+
+/* Loads an UPPAAL model (.xml) with libutap and fills the same tables
+ * as loadIF does for the intermediate file of that model. The
+ * numbering follows verifyta: clock 0 is the reference clock, global
+ * variables come before the local variables of each process, and
+ * locations and edges are numbered in template order.
+ */
+void loadModelXML(const string& modelFile)
+{
+    UTAP::TimedAutomataSystem system;
+    if (parseXMLFile(modelFile.c_str(), &system, true) != 0 || system.hasErrors())
+    {
+        string message = system.getErrors().empty() ? modelFile : system.getErrors().front().message;
+        throw invalid_format("In model: " + message);
+    }
+
+    cell_t reference;
+    reference.type = cell_t::CLOCK;
+    reference.name = "t(0)";
+    reference.clock.nr = clockCount++;
+    clocks.push_back(reference.name);
+    layout.push_back(reference);
+
+    for (auto& variable : system.getGlobals().variables)
+    {
+        addModelVariable(variable.uid.getType(), variable.uid.getName(), variable.expr, nullptr);
+    }
+
+    for (auto& instance : system.getProcesses())
+    {
+        UTAP::template_t& templ = *instance.templ;
+        string processName = instance.uid.getName();
+
+        for (auto& variable : templ.variables)
+        {
+            addModelVariable(variable.uid.getType(), processName + "." + variable.uid.getName(), variable.expr, &instance);
+        }
+
+        process_t process;
+        process.name = processName;
+        process.initial = -1;
+
+        map<const UTAP::state_t*, int> locationIndex;
+        for (auto& state : templ.states)
+        {
+            cell_t cell;
+            cell.type = cell_t::LOCATION;
+            cell.name = state.uid.getName();
+            cell.location.flags = state.uid.getType().is(UTAP::Constants::COMMITTED) ? cell_t::COMMITTED
+                : state.uid.getType().is(UTAP::Constants::URGENT) ? cell_t::URGENT : cell_t::NONE;
+            cell.location.process = processCount;
+            cell.location.invariant = addModelExpression(state.invariant);
+
+            locationIndex[&state] = layout.size();
+            if (state.uid == templ.init)
+            {
+                process.initial = layout.size();
+            }
+            process.locations.push_back(layout.size());
+            layout.push_back(cell);
+        }
+
+        for (auto& templEdge : templ.edges)
+        {
+            if (templEdge.src == nullptr || templEdge.dst == nullptr)
+            {
+                throw invalid_format("In model: branchpoints are not supported");
+            }
+
+            edge_t edge;
+            edge.process = processCount;
+            edge.source = locationIndex.at(templEdge.src);
+            edge.target = locationIndex.at(templEdge.dst);
+            edge.guard = addModelExpression(templEdge.guard);
+            edge.sync = addModelExpression(templEdge.sync);
+            edge.update = addModelExpression(templEdge.assign);
+
+            process.edges.push_back(edges.size());
+            edges.push_back(edge);
+        }
+
+        processes.push_back(process);
+        processCount++;
+    }
+}
+#endif
+
+/* Interns the names of the loaded model, whichever way it was loaded.
+ */
+void internModelNames()
+{
+    processSymbols.clear();
+    for (auto& process : processes)
+    {
+        processSymbols.push_back(symbols.intern(process.name));
+    }
+
+    cellSymbols.clear();
+    for (auto& cell : layout)
+    {
+        cellSymbols.push_back(symbols.intern(cell.name));
+    }
+
+    locationPathSymbols.assign(layout.size(), 0);
+    for (size_t p = 0; p < processes.size(); p++)
+    {
+        for (int location : processes[p].locations)
+        {
+            locationPathSymbols[location] = symbols.intern(processes[p].name + "." + layout[location].name);
+        }
+    }
+}
+
+/* Finds the variables of field in the agents array of each agent,
+ * e.g. the variables of agents[j].a_position for ".a_position". Like
+ * the search the parser did on the formatted states, a variable is
+ * found if its name contains "agents[j]" + field, so an agent may have
+ * more than one.
+ */
+vector<vector<size_t>> findAgentVariables(const string& field)
+{
+    vector<vector<size_t>> slots(std::max(globs.noOfAgents, 0));
+    for (size_t j = 0; j < slots.size(); j++)
+    {
+        string find = "agents[" + to_string(j) + "]" + field;
+        for (size_t v = 0; v < variables.size(); v++)
+        {
+            if (variables[v].find(find) != string::npos)
+            {
+                slots[j].push_back(v);
+            }
+        }
+    }
+    return slots;
+}
+
+/* Resolves the agent variables read by parseState to their index in
+ * the states. Needs both the model and the globs.
+ */
+void resolveAgentSlots()
+{
+    agentPositionSlots = findAgentVariables(".a_position");
+}
+
+/* A bound for a clock constraint. A bound consists of a value and a
+ * bit indicating whether the bound is strict or not.
+ */
+struct bound_t
+{
+    int value : 31; // The value of the bound
+    bool strict : 1;  // True if the bound is strict
+};
+
+/* The bound (infinity, <).
+ */
+static bound_t infinity = { std::numeric_limits<int32_t>::max() >> 1, true };
+
+/* The bound (0, <=).
+ */
+static bound_t zero = { 0, false };
+
+/* A symbolic state. A symbolic state consists of a location vector, a
+ * variable vector and a zone describing the possible values of the
+ * clocks in a symbolic manner.
+ */
+class State
+{
+public:
+    explicit State(std::pmr::memory_resource* memory = std::pmr::get_default_resource(), bool withDBM = true);
+    explicit State(istream& file, std::pmr::memory_resource* memory = std::pmr::get_default_resource(), bool withDBM = true);
+    explicit State(trace_cursor& cursor, std::pmr::memory_resource* memory = std::pmr::get_default_resource(), bool withDBM = true);
+    State(const State& s) = delete;
+    State(State&& s) = delete;
+
+    int& getLocation(int i) { return locations[i]; }
+    int& getVariable(int i) { return integers[i]; }
+    bound_t& getConstraint(int i, int j) { return dbm[i * clockCount + j]; }
+
+    int getLocation(int i) const { return locations[i]; }
+    int getVariable(int i) const { return integers[i]; }
+    bound_t getConstraint(int i, int j) const { return dbm[i * clockCount + j]; }
+private:
+    std::pmr::vector<int> locations;
+    std::pmr::vector<int> integers;
+    std::pmr::vector<bound_t> dbm;
+};
+
+/* The readers construct one State after the other from a pool, so
+ * the memory of each state is reused by the next. Without withDBM the
+ * zone is skipped when the state is read and getConstraint must not
+ * be called.
+ */
+State::State(std::pmr::memory_resource* memory, bool withDBM) : locations(memory), integers(memory), dbm(memory)
+{
+    /* Allocate and fill with default values. */
+    locations.resize(processCount);
+    integers.resize(variableCount);
+    if (!withDBM)
+    {
+        return;
+    }
+    dbm.assign(clockCount * clockCount, infinity);
+
+    /* Set diagonal and lower bounds to zero. */
+    for (size_t i = 0; i < clockCount; i++)
+    {
+        getConstraint(0, i) = zero;
+        getConstraint(i, i) = zero;
+    }
+}
+
+State::State(istream& file, std::pmr::memory_resource* memory, bool withDBM) : State(memory, withDBM)
+{
+    /* Read locations.  */
+    for (auto& l : locations)
+    {
+        file >> l;
+    }
+    file >> readdot;
+
+    /* Read DBM. */
+    int i, j, bnd;
+    while (file >> i >> j >> bnd)
+    {
+        file >> readdot;
+        if (i < 0 || j < 0 || static_cast<size_t>(i) >= clockCount || static_cast<size_t>(j) >= clockCount)
+        {
+            throw invalid_format("Expecting a constraint between two clocks but got '"
+                + to_string(i) + " " + to_string(j) + " " + to_string(bnd) + "'");
+        }
+        if (withDBM)
+        {
+            getConstraint(i, j).value = bnd >> 1;
+            getConstraint(i, j).strict = bnd & 1;
+        }
+    }
+    file.clear();
+    file >> readdot;
+
+    /* Read integers. */
+    for (auto& v : integers)
+    {
+        file >> v;
+    }
+    file >> readdot;
+}
+
+State::State(trace_cursor& cursor, std::pmr::memory_resource* memory, bool withDBM) : State(memory, withDBM)
+{
+    /* Read locations.  */
+    for (auto& l : locations)
+    {
+        readint(cursor, l, "a location");
+    }
+    readdot(cursor);
+
+    /* Read DBM. */
+    if (!withDBM)
+    {
+        skipDBM(cursor);
+    }
+    int i, j, bnd;
+    xtr_token_t token;
+    while (withDBM && (token = nexttoken(cursor, i)) == XTR_INT)
+    {
+        readint(cursor, j, "the second clock of a constraint");
+        readint(cursor, bnd, "the bound of a constraint");
+        readdot(cursor);
+        if (i < 0 || j < 0 || static_cast<size_t>(i) >= clockCount || static_cast<size_t>(j) >= clockCount)
+        {
+            throw invalid_format("Expecting a constraint between two clocks but got '"
+                + to_string(i) + " " + to_string(j) + " " + to_string(bnd) + "'");
+        }
+        getConstraint(i, j).value = bnd >> 1;
+        getConstraint(i, j).strict = bnd & 1;
+    }
+    if (withDBM && token != XTR_DOT)
+    {
+        readdot(cursor);
+    }
+
+    /* Read integers. */
+    for (auto& v : integers)
+    {
+        readint(cursor, v, "a variable");
+    }
+    readdot(cursor);
+}
+
+/* The states of a trace. A state is a row of slots, the location
+ * index of each process followed by the value of each variable.
+ * Consecutive states differ in only a few slots, so the first state is
+ * kept whole and every later state only as the slots that changed.
+ * Every checkpointInterval states a whole copy is kept as well, so a
+ * state_cursor can reach any state without replaying the trace from
+ * the start. Nothing parsed from the trace looks at the zones, so they
+ * are only kept, whole, if asked for.
+ */
+class state_store
+{
+public:
+    explicit state_store(bool withDBM = false) : withDBM(withDBM) {}
+
+    void push_back(const State& s);
+    void append(const state_store& other);
+    void clear();
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    bool hasDBM() const { return withDBM; }
+
+    bool operator==(const state_store& other) const;
+    bool operator!=(const state_store& other) const { return !(*this == other); }
+private:
+    friend class state_cursor;
+
+    static const size_t checkpointInterval = 1024;
+
+    void push_back(const vector<int>& slots);
+
+    size_t width = 0;
+    vector<int> scratch;         //The slots of the state being added.
+    vector<int> current;         //The slots of the last state.
+    vector<int> checkpoints;     //Whole states 0, checkpointInterval, 2 * checkpointInterval, ...
+    vector<uint32_t> deltaSlots; //The slots that changed, state after state.
+    vector<int> deltaValues;     //The values they changed to.
+    vector<size_t> deltaEnd;     //Where the changes of each state end in deltaSlots.
+    vector<bound_t> dbm;
+    size_t count = 0;
+    bool withDBM;
+};
+
+/* Reconstructs the states of a state_store. Moving to the next state
+ * only applies the slots that changed; any other state is reached from
+ * the checkpoint before it.
+ */
+class state_cursor
+{
+public:
+    explicit state_cursor(const state_store& store) : store(store) {}
+
+    void seek(size_t index);
+    size_t index() const { return position; }
+
+    int getLocation(size_t process) const { return slots[process]; }
+    int getVariable(size_t variable) const { return slots[processCount + variable]; }
+    bound_t getConstraint(size_t i, size_t j) const { return store.dbm[(position * clockCount + i) * clockCount + j]; }
+private:
+    friend class state_store;
+
+    void apply(size_t index);
+
+    const state_store& store;
+    vector<int> slots;
+    size_t position = 0;
+    bool loaded = false;
+};
+
+void state_store::push_back(const State& s)
+{
+    scratch.clear();
+    for (size_t p = 0; p < processCount; p++)
+    {
+        scratch.push_back(s.getLocation(p));
+    }
+    for (size_t v = 0; v < variableCount; v++)
+    {
+        scratch.push_back(s.getVariable(v));
+    }
+    push_back(scratch);
+
+    if (withDBM)
+    {
+        for (size_t i = 0; i < clockCount; i++)
+        {
+            for (size_t j = 0; j < clockCount; j++)
+            {
+                dbm.push_back(s.getConstraint(i, j));
+            }
+        }
+    }
+}
+
+void state_store::push_back(const vector<int>& slots)
+{
+    if (count == 0)
+    {
+        width = slots.size();
+        current = slots;
+    }
+    else
+    {
+        for (size_t s = 0; s < width; s++)
+        {
+            if (slots[s] != current[s])
+            {
+                deltaSlots.push_back(static_cast<uint32_t>(s));
+                deltaValues.push_back(slots[s]);
+                current[s] = slots[s];
+            }
+        }
+    }
+    deltaEnd.push_back(deltaSlots.size());
+
+    if (count % checkpointInterval == 0)
+    {
+        checkpoints.insert(checkpoints.end(), current.begin(), current.end());
+    }
+    count++;
+}
+
+/* Adds the states of other after the states of this store.
+ */
+void state_store::append(const state_store& other)
+{
+    state_cursor cursor(other);
+    for (size_t i = 0; i < other.count; i++)
+    {
+        cursor.seek(i);
+        push_back(cursor.slots);
+    }
+    if (withDBM)
+    {
+        dbm.insert(dbm.end(), other.dbm.begin(), other.dbm.end());
+    }
+}
+
+/* Empties the store but keeps its memory.
+ */
+void state_store::clear()
+{
+    current.clear();
+    checkpoints.clear();
+    deltaSlots.clear();
+    deltaValues.clear();
+    deltaEnd.clear();
+    dbm.clear();
+    count = 0;
+}
+
+bool state_store::operator==(const state_store& other) const
+{
+    if (count != other.count || withDBM != other.withDBM)
+    {
+        return false;
+    }
+    //The encoding of a sequence of states is unique.
+    return checkpoints == other.checkpoints
+        && deltaSlots == other.deltaSlots
+        && deltaValues == other.deltaValues
+        && deltaEnd == other.deltaEnd
+        && std::equal(dbm.begin(), dbm.end(), other.dbm.begin(), other.dbm.end(),
+            [](bound_t a, bound_t b) { return a.value == b.value && a.strict == b.strict; });
+}
+
+/* Applies the slots that changed in state index to the slots of the
+ * state before it.
+ */
+void state_cursor::apply(size_t index)
+{
+    size_t begin = store.deltaEnd[index - 1];
+    size_t end = store.deltaEnd[index];
+    for (size_t d = begin; d < end; d++)
+    {
+        slots[store.deltaSlots[d]] = store.deltaValues[d];
+    }
+}
+
+void state_cursor::seek(size_t index)
+{
+    if (loaded && index == position + 1)
+    {
+        apply(index);
+        position = index;
+        return;
+    }
+    //Seeking the current state again reloads it, the store may have been refilled.
+    if (!loaded || index <= position || index / state_store::checkpointInterval != position / state_store::checkpointInterval)
+    {
+        size_t checkpoint = index / state_store::checkpointInterval;
+        auto first = store.checkpoints.begin() + checkpoint * store.width;
+        slots.assign(first, first + store.width);
+        position = checkpoint * state_store::checkpointInterval;
+        loaded = true;
+    }
+    while (position < index)
+    {
+        apply(++position);
+    }
+}
+
+/* The states of the trace being converted.
+ */
+state_store traceStates;
+
+struct Edge
+{
+    int process;
+    int edge;
+    std::pmr::vector<int> select;
+};
+
+/* A transition consists of one or more edges. Edges are indexes from
+ * 0 in the order they appear in the input file.
+ */
+struct Transition
+{
+    std::pmr::vector<Edge> edges;
+    explicit Transition(istream& file, std::pmr::memory_resource* memory = std::pmr::get_default_resource());
+    explicit Transition(trace_cursor& cursor, std::pmr::memory_resource* memory = std::pmr::get_default_resource());
+};
+
+//Here the unParsedTransitions are filled.
+Transition::Transition(istream& file, std::pmr::memory_resource* memory) : edges(memory)
+{
+    int process, edge, select;
+    while (file >> process >> edge)
+    {
+        Edge e{ process, edge, std::pmr::vector<int>(memory) };
+        file >> skipspaces;
+        while (file.peek() != '\n' && file.peek() != ';')
+        {
+            if (file >> select)
+            {
+                e.select.push_back(select);
+            }
+            else
+            {
+                throw invalid_format("Transition format error");
+            }
+            file >> skipspaces;
+        }
+        if (file.get() == '\n') // old format without ';'
+        {   // old format indexes edges from 1, hence convert to 0-base
+            e.edge--;
+        }
+        edges.push_back(e);
+    }
+    file.clear();
+    file >> readdot;
+}
+
+Transition::Transition(trace_cursor& cursor, std::pmr::memory_resource* memory) : edges(memory)
+{
+    int process, edge, select;
+    while (readint(cursor, process) && readint(cursor, edge))
+    {
+        Edge e{ process, edge, std::pmr::vector<int>(memory) };
+        skipspaces(cursor);
+        while (cursor.pos != cursor.end && *cursor.pos != '\n' && *cursor.pos != '\r' && *cursor.pos != ';')
+        {
+            if (readint(cursor, select))
+            {
+                e.select.push_back(select);
+            }
+            else
+            {
+                throw invalid_format("Transition format error");
+            }
+            skipspaces(cursor);
+        }
+        if (cursor.pos == cursor.end || *cursor.pos != ';') // old format without ';'
+        {   // old format indexes edges from 1, hence convert to 0-base
+            e.edge--;
+        }
+        if (cursor.pos != cursor.end)
+        {
+            cursor.pos++;
+        }
+        edges.push_back(e);
+    }
+    readdot(cursor);
+}
+
+/* An edge of a transition as it is kept for parsing: the index of
+ * the process, of the edge in edges and of the source and target
+ * location in layout, and the select values. Names and expressions
+ * are looked up from the model when they are needed.
+ */
+struct transition_edge
+{
+    int process;
+    int edge;
+    int source;
+    int target;
+    std::pmr::vector<int> select;
+
+    bool operator==(const transition_edge& other) const
+    {
+        return process == other.process && edge == other.edge && source == other.source
+            && target == other.target && select == other.select;
+    }
+};
+
+/* Records a transition, one transition_edge per edge.
+ */
+transition_record recordTransition(const Transition& t, std::pmr::memory_resource* memory)
+{
+    transition_record outTrans(memory);
+    outTrans.reserve(t.edges.size());
+    for (auto& edge : t.edges)
+    {
+        int eid = processes[edge.process].edges[edge.edge];
+        transition_edge outEdge{ edge.process, eid, edges[eid].source, edges[eid].target, std::pmr::vector<int>(memory) };
+        outEdge.select.assign(edge.select.begin(), edge.select.end());
+        outTrans.push_back(std::move(outEdge));
+    }
+    return outTrans;
+}
+
+/* Returns the text of an expression, or an empty string for an
+ * unknown index.
+ */
+const string& getExpression(int index)
+{
+    static const string empty;
+    return index >= 0 && static_cast<size_t>(index) < expressions.size() ? expressions[index] : empty;
+}
+
+/* Prints a symbolic state in the text form of the UPPAAL tracer: the
+ * location vector, the variables and the zone. The state must have
+ * been read with its zone.
+ */
+void printState(ostream& out, const State& state)
+{
+    out << "State:" << endl;
+
+    /* Print location vector. */
+    for (size_t p = 0; p < processCount; p++)
+    {
+        int idx = processes[p].locations[state.getLocation(p)];
+        out << processes[p].name << '.' << layout[idx].name << " ";
+    }
+    out << endl;
+
+    /* Print variables. */
+    for (size_t v = 0; v < variableCount; v++)
+    {
+        out << variables[v] << "=" << state.getVariable(v) << ' ';
+    }
+    out << endl;
+
+    /* Print clocks. */
+    for (size_t i = 0; i < clockCount; i++)
+    {
+        for (size_t j = 0; j < clockCount; j++)
+        {
+            bound_t bnd = state.getConstraint(i, j);
+            if (i != j && bnd.value != infinity.value)
             {
-                int index;
-                int process;
-                int invariant;
+                out << clocks[i] << "-" << clocks[j]
+                    << (bnd.strict ? "<" : "<=") << bnd.value << " ";
+            }
+        }
+    }
+    out << endl << endl;
+}
 
-                if (sscanf(str.c_str(), "%d:%d:%d", &index, &process, &invariant) != 3)
-                {
-                    throw invalid_format("In location section");
-                }
+/* Prints a transition in the text form of the UPPAAL tracer. Lists
+ * all edges in the transition with their source and destination, and
+ * with --verbose their guard, synchronisation and assignment.
+ */
+void printTransition(ostream& out, const Transition& t)
+{
+    out << "Transition:" << endl;
+    for (auto& edge : t.edges)
+    {
+        int eid = processes[edge.process].edges[edge.edge];
+        const string& name = processes[edge.process].name;
 
-                layout[index].location.process = process;
-                layout[index].location.invariant = invariant;
-                processes[process].locations.push_back(index);
+        out << "  " << name << '.' << layout[edges[eid].source].name
+            << " -> " << name << '.' << layout[edges[eid].target].name;
+
+        if (!edge.select.empty())
+        {
+            out << " [";
+            for (size_t s = 0; s < edge.select.size(); s++)
+            {
+                out << (s > 0 ? "," : "") << edge.select[s];
             }
+            out << "]";
         }
-        else if (section == "edges")
+
+        if (verboseTrace)
         {
-            while (read(file, str) && !str.empty() && !isspace(str[0]))
-            {
-                edge_t edge;
+            out << " {" << getExpression(edges[eid].guard) << "; "
+                << getExpression(edges[eid].sync) << "; "
+                << getExpression(edges[eid].update) << ";}";
+        }
+        out << endl;
+    }
+    out << endl;
+}
 
-                if (sscanf(str.c_str(), "%d:%d:%d:%d:%d:%d", &edge.process,
-                    &edge.source, &edge.target,
-                    &edge.guard, &edge.sync, &edge.update) != 6)
-                {
-                    throw invalid_format("In edge section");
-                }
+/* Receives the states and transitions of a trace. The initial state
+ * comes first, after that each transition is followed by the state it
+ * leads to.
+ */
+class trace_sink
+{
+public:
+    virtual ~trace_sink() = default;
+    virtual void state(const State& s) = 0;
+    virtual void transition(const Transition& t) = 0;
+    //Whether the zones of the states are read. They are skipped otherwise.
+    virtual bool wantsDBM() const { return false; }
+};
 
-                processes[edge.process].edges.push_back(edges.size());
-                edges.push_back(edge);
-            }
+/* Keeps the whole trace, the states in a state_store and the
+ * transitions as transition_edge records allocated from arena.
+ */
+//Here the traceStates and unParsedTransition are filled.
+class trace_collector : public trace_sink
+{
+public:
+    trace_collector(state_store& states, vector<transition_record>& transitions, trace_arena& arena)
+        : states(states), transitions(transitions), arena(arena) {}
+
+    void state(const State& s) override { states.push_back(s); }
+    void transition(const Transition& t) override { transitions.push_back(recordTransition(t, &arena)); }
+    bool wantsDBM() const override { return states.hasDBM(); }
+private:
+    state_store& states;
+    vector<transition_record>& transitions;
+    trace_arena& arena;
+};
+
+/* Prints the states and transitions of a trace in the text form of the
+ * UPPAAL tracer while passing them on to another sink.
+ */
+class trace_printer : public trace_sink
+{
+public:
+    trace_printer(ostream& out, trace_sink& next) : out(out), next(next) {}
+
+    void state(const State& s) override
+    {
+        printState(out, s);
+        next.state(s);
+    }
+    void transition(const Transition& t) override
+    {
+        printTransition(out, t);
+        next.transition(t);
+    }
+    bool wantsDBM() const override { return true; }
+private:
+    ostream& out;
+    trace_sink& next;
+};
+
+/* Read a trace file and pass it on to sink.
+ */
+void loadTrace(istream& file, trace_sink& sink)
+{
+    std::pmr::unsynchronized_pool_resource pool;
+    bool withDBM = sink.wantsDBM();
+    sink.state(State(file, &pool, withDBM));
+
+    for (;;)
+    {
+        /* Skip white space. */
+        file >> skipspaces;
+
+        /* A dot terminates the trace. */
+        if (file.peek() == '.')
+        {
+            file.get();
+            break;
         }
-        else if (section == "expressions")
+
+        /* Read a state and a transition. */
+        State state(file, &pool, withDBM);
+        Transition transition(file, &pool);
+
+        /* Print transition and state. */
+        sink.transition(transition);
+        sink.state(state);
+
+    }
+}
+/* Read a trace held in memory, e.g. a mapped trace file, and pass it
+ * on to sink.
+ */
+void loadTrace(trace_cursor& cursor, trace_sink& sink)
+{
+    std::pmr::unsynchronized_pool_resource pool;
+    bool withDBM = sink.wantsDBM();
+    sink.state(State(cursor, &pool, withDBM));
+
+    for (;;)
+    {
+        /* Skip white space. */
+        skipwhitespace(cursor);
+
+        /* A dot terminates the trace. */
+        if (cursor.pos == cursor.end || *cursor.pos == '.')
         {
-            while (read(file, str) && !str.empty() && !isspace(str[0]))
-            {
-                if (sscanf(str.c_str(), "%d", &index) != 1)
-                {
-                    throw invalid_format("In expression section");
-                }
+            break;
+        }
 
-                /* Find expression string (after the third colon). */
-                auto* s = str.c_str();
-                int cnt = 3;
-                while (cnt && *s)
-                {
-                    cnt -= (*s == ':');
-                    s++;
-                }
-                if (cnt)
-                {
-                    throw invalid_format("In expression section");
-                }
+        /* Read a state and a transition. */
+        State state(cursor, &pool, withDBM);
+        Transition transition(cursor, &pool);
 
-                /* Trim white space. */
-                while (*s && isspace(*s))
-                {
-                    s++;
-                }
-                auto* t = s + strlen(s) - 1;
-                while (t >= s && isspace(*t))
-                {
-                    t--;
-                }
+        /* Print transition and state. */
+        sink.transition(transition);
+        sink.state(state);
+    }
+}
+
+/* Reads a trace file with the reader selected on the command line.
+ */
+void readTrace(const string& traceFile, trace_sink& sink)
+{
+    //Compressed traces are decompressed while they are read, they cannot be mapped.
+    //Pipes are read as the data arrives, so --stream prints while the writer is still running.
+    if (!legacyReader && isRegularFile(traceFile) && detectCompression(traceFile) == COMPRESSION_NONE)
+    {
+        mapped_file file(traceFile);
+        if (file.is_open())
+        {
+            trace_cursor cursor{ file.begin(), file.end() };
+            loadTrace(cursor, sink);
+            return;
+        }
+    }
+
+    input_file file(traceFile);
+    loadTrace(file, sink);
+}
+
+/* Returns true if the line starting at p is a lone dot.
+ */
+inline
+bool isDotLine(const char* p, const char* eol)
+{
+    while (p != eol && static_cast<unsigned char>(*p) <= ' ')
+    {
+        p++;
+    }
+    if (p == eol || *p != '.')
+    {
+        return false;
+    }
+    p++;
+    while (p != eol && static_cast<unsigned char>(*p) <= ' ')
+    {
+        p++;
+    }
+    return p == eol;
+}
+
+/* Finds where each record of a trace starts. The first record is the
+ * initial state, every later record a state and a transition. Only dot
+ * lines are looked at: a state ends with the dot after its integers,
+ * which is the first dot after the two consecutive dots closing the
+ * DBM, and a transition ends with the dot after its edges. The returned
+ * vector ends with the position of the dot terminating the trace.
+ */
+vector<const char*> findRecords(const char* begin, const char* end)
+{
+    vector<const char*> records;
+    records.push_back(begin);
+
+    bool initial = true;
+    bool empty = true; //Nothing of the current record has been seen yet.
+    bool previousDot = false;
+    int phase = 0; //0: in state, 1: after DBM, 2: in transition
+    const char* p = begin;
+    while (p != end)
+    {
+        const void* found = memchr(p, '\n', end - p);
+        const char* eol = found ? static_cast<const char*>(found) : end;
+        const char* next = found ? eol + 1 : end;
 
-                expressions[index] = string(s, t + 1);
+        bool dot = isDotLine(p, eol);
+        if (!dot && std::all_of(p, eol, [](char c) { return static_cast<unsigned char>(c) <= ' '; }))
+        {
+            p = next;
+            continue;
+        }
+
+        //A dot where a new record would start terminates the trace.
+        if (dot && empty && !initial)
+        {
+            records.back() = p;
+            return records;
+        }
+        empty = false;
+
+        if (dot)
+        {
+            if (phase == 0 && previousDot)
+            {
+                phase = 1;
+            }
+            else if (phase == 1)
+            {
+                phase = initial ? 3 : 2;
+            }
+            else if (phase == 2)
+            {
+                phase = 3;
             }
         }
-        else
+        previousDot = dot;
+
+        if (phase == 3)
         {
-            throw invalid_format("Unknown section");
+            records.push_back(next);
+            initial = false;
+            empty = true;
+            previousDot = false;
+            phase = 0;
         }
+        p = next;
     }
-};
+    records.push_back(end);
+    return records;
+}
 
-/* A bound for a clock constraint. A bound consists of a value and a
- * bit indicating whether the bound is strict or not.
+/* Runs worker on threadCount threads, the calling thread being one of
+ * them, and waits for all of them. Each call gets the number of its
+ * thread. An exception thrown by a worker, or the failure to start a
+ * thread, is passed on once all threads that were started are done.
  */
-struct bound_t
+void runWorkers(unsigned threadCount, const std::function<void(unsigned)>& worker)
 {
-    int value : 31; // The value of the bound
-    bool strict : 1;  // True if the bound is strict
-};
+    std::exception_ptr error;
+    std::mutex errorLock;
+    auto guarded = [&](unsigned t)
+    {
+        try
+        {
+            worker(t);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(errorLock);
+            if (!error)
+            {
+                error = std::current_exception();
+            }
+        }
+    };
+
+    vector<std::thread> pool;
+    try
+    {
+        for (unsigned t = 1; t < threadCount; t++)
+        {
+            pool.emplace_back(guarded, t);
+        }
+    }
+    catch (...)
+    {
+        for (auto& thread : pool)
+        {
+            thread.join();
+        }
+        throw;
+    }
+    guarded(0);
+    for (auto& thread : pool)
+    {
+        thread.join();
+    }
+
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+}
+
+/* Reads a mapped trace on several threads. The trace is split into
+ * chunks of whole records, each chunk is parsed and formatted on its
+ * own, and the chunks are appended to states and transitions in order.
+ */
+void loadTraceParallel(const char* begin, const char* end, state_store& states,
+    vector<transition_record>& transitions, unsigned threadCount, trace_arena& arena)
+{
+    vector<const char*> records = findRecords(begin, end);
+    size_t recordCount = records.size() - 1;
+
+    struct chunk_t
+    {
+        size_t first;
+        size_t last;
+        state_store states;
+        vector<transition_record> transitions;
+        trace_arena* arena;
+    };
+
+    //A few chunks per thread evens out chunks of different cost.
+    size_t chunkCount = std::max<size_t>(1, std::min<size_t>(recordCount, static_cast<size_t>(threadCount) * 4));
+    vector<chunk_t> chunks(chunkCount);
+    for (size_t c = 0; c < chunkCount; c++)
+    {
+        chunks[c].states = state_store(states.hasDBM());
+        chunks[c].arena = &arena.split();
+        chunks[c].first = recordCount * c / chunkCount;
+        chunks[c].last = recordCount * (c + 1) / chunkCount;
+    }
+
+    std::atomic<size_t> nextChunk(0);
+    auto worker = [&](unsigned)
+    {
+        size_t c;
+        while ((c = nextChunk++) < chunkCount)
+        {
+            chunk_t& chunk = chunks[c];
+            trace_collector collector(chunk.states, chunk.transitions, *chunk.arena);
+            std::pmr::unsynchronized_pool_resource pool;
+            for (size_t r = chunk.first; r < chunk.last; r++)
+            {
+                trace_cursor cursor{ records[r], records[r + 1] };
+                if (r == 0)
+                {
+                    collector.state(State(cursor, &pool, states.hasDBM()));
+                }
+                else
+                {
+                    State state(cursor, &pool, states.hasDBM());
+                    Transition transition(cursor, &pool);
+                    collector.transition(transition);
+                    collector.state(state);
+                }
+            }
+        }
+    };
 
-/* The bound (infinity, <).
- */
-static bound_t infinity = { std::numeric_limits<int32_t>::max() >> 1, true };
+    //More threads than chunks would have nothing to do.
+    runWorkers(static_cast<unsigned>(std::min<size_t>(threadCount, chunkCount)), worker);
 
-/* The bound (0, <=).
- */
-static bound_t zero = { 0, false };
+    for (auto& chunk : chunks)
+    {
+        states.append(chunk.states);
+        std::move(chunk.transitions.begin(), chunk.transitions.end(), std::back_inserter(transitions));
+    }
+}
 
-/* A symbolic state. A symbolic state consists of a location vector, a
- * variable vector and a zone describing the possible values of the
- * clocks in a symbolic manner.
+/* Reads a trace file into states and transitions, in parallel if the
+ * trace can be mapped.
  */
-class State
+void readTraceParallel(const string& traceFile, state_store& states,
+    vector<transition_record>& transitions, unsigned threadCount, trace_arena& arena)
 {
-public:
-    State();
-    explicit State(istream& file);
-    State(const State& s) = delete;
-    State(State&& s) = delete;
-    ~State();
+    if (legacyReader || !isRegularFile(traceFile) || detectCompression(traceFile) != COMPRESSION_NONE)
+    {
+        trace_collector collector(states, transitions, arena);
+        readTrace(traceFile, collector);
+        return;
+    }
+    mapped_file file(traceFile);
+    if (!file.is_open())
+    {
+        trace_collector collector(states, transitions, arena);
+        readTrace(traceFile, collector);
+        return;
+    }
+    loadTraceParallel(file.begin(), file.end(), states, transitions, threadCount, arena);
+}
 
-    int& getLocation(int i) { return locations[i]; }
-    int& getVariable(int i) { return integers[i]; }
-    bound_t& getConstraint(int i, int j) { return dbm[i * clockCount + j]; }
+/* Reads the trace with both the cursor and the istream reader, and
+ * with the parallel reader if --threads is given, and fails if they do
+ * not produce the same states and transitions.
+ */
+void checkTraceReader(const string& traceFile)
+{
+    if (!isRegularFile(traceFile))
+    {
+        cerr << "A piped trace can only be read once, nothing to compare" << endl;
+        return;
+    }
+    if (detectCompression(traceFile) != COMPRESSION_NONE)
+    {
+        cerr << "Only the istream reader reads compressed traces, nothing to compare" << endl;
+        return;
+    }
 
-    int getLocation(int i) const { return locations[i]; }
-    int getVariable(int i) const { return integers[i]; }
-    bound_t getConstraint(int i, int j) const { return dbm[i * clockCount + j]; }
-private:
-    vector<int> locations;
-    vector<int> integers;
-    bound_t* dbm;
-    void allocate();
-};
+    //The zones are compared as well.
+    trace_arena arena;
+    state_store cursorStates(true), streamStates(true);
+    vector<transition_record> cursorTransitions, streamTransitions;
 
-State::~State()
-{
-    delete[] dbm;
-}
+    mapped_file mapped(traceFile);
+    trace_cursor cursor{ mapped.begin(), mapped.end() };
+    trace_collector cursorCollector(cursorStates, cursorTransitions, arena);
+    loadTrace(cursor, cursorCollector);
 
-State::State()
-{
-    /* Allocate. */
-    locations.resize(processCount);
-    integers.resize(variableCount);
-    dbm = new bound_t[clockCount * clockCount];
+    ifstream file(traceFile);
+    trace_collector streamCollector(streamStates, streamTransitions, arena);
+    loadTrace(file, streamCollector);
 
-    /* Fill with default values. */
-    std::fill(dbm, dbm + clockCount * clockCount, infinity);
+    if (cursorStates != streamStates || cursorTransitions != streamTransitions)
+    {
+        cerr << "Trace readers disagree on " << traceFile << endl;
+        exit(EXIT_FAILURE);
+    }
 
-    /* Set diagonal and lower bounds to zero. */
-    for (size_t i = 0; i < clockCount; i++)
+    if (traceThreads > 1)
     {
-        getConstraint(0, i) = zero;
-        getConstraint(i, i) = zero;
+        state_store parallelStates(true);
+        vector<transition_record> parallelTransitions;
+        loadTraceParallel(mapped.begin(), mapped.end(), parallelStates, parallelTransitions, traceThreads, arena);
+
+        if (cursorStates != parallelStates || cursorTransitions != parallelTransitions)
+        {
+            cerr << "Parallel trace reader disagrees on " << traceFile << endl;
+            exit(EXIT_FAILURE);
+        }
     }
 }
 
-State::State(istream& file) : State()
+///////////////////////////////////////////// code from tracer.cpp ends here
+
+
+//Finds the agent of each process.
+void fillProcessAgents()
 {
-    /* Read locations.  */
-    for (auto& l : locations)
+    processAgents.assign(processes.size(), -1);
+
+    if (processes.empty())
+        return;
+
+    //The process names end in "_" and the name of their agent. The agents are numbered in the order they first appear.
+    //Processes before the start offset are not agents.
+    vector<string> agNames;
+    std::unordered_map<string, int> agentIds;
+    for (size_t i = globs.startOffset; i < processes.size(); i++)
     {
-        file >> l;
+        const string& procName = processes[i].name;
+        string agName = procName.substr(procName.find_last_of("_") + 1);
+        if (agentIds.emplace(agName, static_cast<int>(agNames.size())).second)
+        {
+            agNames.push_back(agName);
+        }
     }
-    file >> readdot;
 
-    /* Read DBM. */
-    int i, j, bnd;
-    while (file >> i >> j >> bnd)
+    if (agNames.size() < static_cast<size_t>(globs.noOfAgents))
     {
-        file >> readdot;
-        getConstraint(i, j).value = bnd >> 1;
-        getConstraint(i, j).strict = bnd & 1;
+        throw invalid_format("The model has " + to_string(agNames.size()) + " agents, the globs file " + to_string(globs.noOfAgents));
     }
-    file.clear();
-    file >> readdot;
 
-    /* Read integers. */
-    for (auto& v : integers)
+    //A process belongs to the agent whose name is exactly the end of the process name, so agent 1 does not also own the processes of agent 11.
+    for (size_t p = 0; p < processes.size(); p++)
     {
-        file >> v;
+        const string& procName = processes[p].name;
+        auto agent = agentIds.find(procName.substr(procName.find_last_of("_") + 1));
+        if (agent == agentIds.end() || agent->second >= globs.noOfAgents)
+        {
+            continue;
+        }
+        processAgents[p] = agent->second;
     }
-    file >> readdot;
 }
 
-struct Edge
-{
-    int process;
-    int edge;
-    vector<int> select;
-};
+//What taking an edge means for the agent of its process, found from the globs once per edge by classifyEdges.
+enum edge_kind_t { EDGE_NONE, EDGE_TASK_START, EDGE_TASK_FINISH, EDGE_MOVE_START, EDGE_MOVE_FINISH };
 
-/* A transition consists of one or more edges. Edges are indexes from
- * 0 in the order they appear in the input file.
- */
-struct Transition
+struct edge_class_t
 {
-    vector<Edge> edges;
-    explicit Transition(istream& file);
+    edge_kind_t kind;
+    symbol_t target; //"process.target", the target of the action.
 };
 
-//Here the unParsedTransitions are filled.
-Transition::Transition(istream& file)
+//Indexed like edges.
+static vector<edge_class_t> edgeClasses;
+
+//Classifies every edge of the model. Needs the interned model names and the globs.
+//A task edge is in a process whose name contains the task identifier and a move edge in one whose name contains the milestone identifier.
+//The kind depends on the names of the source and target location. Finishing wins if an edge would both start and finish.
+void classifyEdges()
 {
-    int process, edge, select;
-    while (file >> process >> edge)
+    edgeClasses.assign(edges.size(), edge_class_t{ EDGE_NONE, 0 });
+    taskIds.assign(1, 0);
+    int taskCount = 1;
+
+    for (size_t e = 0; e < edges.size(); e++)
     {
-        Edge e{ process, edge };
-        file >> skipspaces;
-        while (file.peek() != '\n' && file.peek() != ';')
+        const string& process = symbols.name(processSymbols[edges[e].process]);
+        uint32_t source = locationPatterns.match(symbols.name(cellSymbols[edges[e].source]));
+        uint32_t target = locationPatterns.match(symbols.name(cellSymbols[edges[e].target]));
+        edge_class_t& edgeClass = edgeClasses[e];
+
+        //Task
+        if (process.find(globs.taskNameIdentifier) != string::npos)
         {
-            if (file >> select)
+            if ((source & TASK_START_FROM) && (target & TASK_START_TO))
             {
-                e.select.push_back(select);
+                edgeClass.kind = EDGE_TASK_START;
             }
-            else
+            if ((source & TASK_FINISH_FROM) && (target & TASK_FINISH_TO))
             {
-                cerr << "Transition format error" << endl;
-                exit(EXIT_FAILURE);
+                edgeClass.kind = EDGE_TASK_FINISH;
             }
-            file >> skipspaces;
         }
-        if (file.get() == '\n') // old format without ';'
-        {   // old format indexes edges from 1, hence convert to 0-base
-            e.edge--;
+        //Milestones
+        else if (process.find(globs.milestoneNameIdentifier) != string::npos)
+        {
+            if ((source & MOVE_START_FROM) && (target & MOVE_START_TO))
+            {
+                edgeClass.kind = EDGE_MOVE_START;
+            }
+            if ((source & MOVE_FINISH_FROM) && (target & MOVE_FINISH_TO))
+            {
+                edgeClass.kind = EDGE_MOVE_FINISH;
+            }
+        }
+
+        if (edgeClass.kind != EDGE_NONE)
+        {
+            edgeClass.target = locationPathSymbols[edges[e].target];
+        }
+
+        //Numbers the tasks in the order their first start edge is found.
+        if (edgeClass.kind == EDGE_TASK_START)
+        {
+            if (taskIds.size() <= edgeClass.target)
+            {
+                taskIds.resize(edgeClass.target + 1, -1);
+            }
+            if (taskIds[edgeClass.target] < 0)
+            {
+                taskIds[edgeClass.target] = taskCount++;
+            }
         }
-        edges.push_back(e);
     }
-    file.clear();
-    file >> readdot;
 }
 
-/* Output operator for a symbolic state. Prints the location vector,
- * the variables and the zone of the symbolic state.
- */
- //Here the unParsedStates are filled.
-ostream& operator << (ostream& o, const State& state)
+//The action type printed for an edge kind, as named in the globs.
+const string& edgeKindName(edge_kind_t kind)
 {
-    vector<string> outState;
-    stringstream outputState;
-    /* Print location vector. */
-    for (size_t p = 0; p < processCount; p++)
+    static const string none;
+    switch (kind)
     {
-        int idx = processes[p].locations[state.getLocation(p)];
-        outputState << processes[p].name << '.' << layout[idx].name << " ";
-
-        string temp;
-        outputState >> temp;
-        outState.push_back(temp);
-        outputState << endl;
+    case EDGE_TASK_START: return globs.taskStart;
+    case EDGE_TASK_FINISH: return globs.taskFinish;
+    case EDGE_MOVE_START: return globs.moveStart;
+    case EDGE_MOVE_FINISH: return globs.moveFinish;
+    default: return none;
     }
+}
 
-    /* Print variables. */
-    for (size_t v = 0; v < variableCount; v++)
+//Fills the action of one step from the transition taken in it. transition is null for the last step, which has none.
+//A synchronisation moves several processes in one transition, so every edge gives an action to the agent owning its process.
+//If one agent has several edges in the transition, its action is the last of them that is a task or a move.
+parsed_action parseAction(const transition_record* transition)
+{
+    parsed_action action;
+    if (transition == nullptr)
     {
-        outputState << variables[v] << "=" << state.getVariable(v) << ' ';
-
-        string temp;
-        outputState >> temp;
-        outState.push_back(temp);
-        outputState << endl;
+        return action;
     }
-    int i = 5;
-    i++;
-    /* Print clocks. */
-    for (size_t i = 0; i < clockCount; i++)
+
+    for (const transition_edge& edge : *transition)
     {
-        for (size_t j = 0; j < clockCount; j++)
+        int agent = processAgents[edge.process];
+        if (agent < 0)
         {
-            if (i != j)
-            {
-                bound_t bnd = state.getConstraint(i, j);
+            continue;
+        }
+        const edge_class_t& edgeClass = edgeClasses[edge.edge];
 
-                if (bnd.value != infinity.value)
-                {
-                    string temp1;
-                    string temp2;
-                    string temp3;
-                    string temp4;
-                    stringstream temp5;
-
-                    temp5 << clocks[i] << endl;
-                    temp5 >> temp1;
-                    temp5 << clocks[j] << endl;;
-                    temp5 >> temp2;
-                    temp5 << (bnd.strict ? "<" : "<=") << endl;;
-                    temp5 >> temp3;
-                    temp5 << bnd.value << endl;;
-                    temp5 >> temp4;
-
-                    outputState << clocks[i] << "-" << clocks[j]
-                        << (bnd.strict ? "<" : "<=") << bnd.value << " ";
+        auto actionAgent = std::find_if(action.Agents.begin(), action.Agents.end(),
+            [agent](const parsed_action_agent& other) { return other.Id == agent; });
+        if (actionAgent == action.Agents.end())
+        {
+            action.Agents.emplace_back();
+            actionAgent = action.Agents.end() - 1;
+            actionAgent->Id = agent;
 
-                    string temp;
-                    outputState >> temp;
-                    outState.push_back(temp);
-                    outputState << endl;
-                }
-            }
+            //Need to fixer lower bound time;
+            actionAgent->TimeInt.assign({ 0, globs.maxTime });
+        }
+        else if (edgeClass.kind == EDGE_NONE)
+        {
+            continue;
         }
+
+        //Checks if the action move is in a task or a milestone
+        actionAgent->Type = edgeKindName(edgeClass.kind);
+        actionAgent->Target = edgeClass.target;
     }
-    unParsedStates.push_back(outState);
 
-    return o;
+    //In the order of the agents, as the transition lists its edges in the order of the processes.
+    std::sort(action.Agents.begin(), action.Agents.end(),
+        [](const parsed_action_agent& a, const parsed_action_agent& b) { return a.Id < b.Id; });
+    return action;
 }
 
-/* Output operator for a transition. Prints all edges in the
- * transition including the source, destination, guard,
- * synchronisation and assignment.
- */
-ostream& operator << (ostream& o, const Transition& t)
+//Fills the parsed state of agent j in one step from the unparsed state, the action of the same step and the state of the agent in the step before. previous is null for the first step.
+parsed_state_agent parseStateAgent(const state_cursor& unParsedState, const parsed_action& action, const parsed_state_agent* previous, int j)
 {
-    vector<vector<string>> outTrans;
-    for (auto& edge : t.edges)
-    {
-        int eid = processes[edge.process].edges[edge.edge];
-        int src = edges[eid].source;
-        int dst = edges[eid].target;
-        int guard = edges[eid].guard;
-        int sync = edges[eid].sync;
-        int update = edges[eid].update;
+    parsed_state_agent stateAgent;
 
-        string temp;
-        vector<string> outTransition;
-
-        outTransition.push_back(processes[edge.process].name);
-
-        outTransition.push_back(".");
-        outTransition.push_back(layout[src].name);
-        outTransition.push_back(" -> ");
-        outTransition.push_back(processes[edge.process].name);
-        outTransition.push_back(".");
-        outTransition.push_back(layout[dst].name);
-
-        if (!edge.select.empty()) {
-            auto s = edge.select.begin(), se = edge.select.end();
+    //Gets the int value of the agents[j].a_position variable and matches it with the milestoneValue
+    for (size_t v : agentPositionSlots.at(j))
+    {
+        int value = unParsedState.getVariable(v);
+        for (int l = 0; l < globs.milestoneValues.size(); l++)
+        {
+            if (globs.milestoneValues.at(l).value == value)
+            {
+                stateAgent.Milestone = globs.milestoneValues.at(l);
+            }
+        }
+    }
 
+    if (previous == nullptr)
+    {
+        stateAgent.Id = j;
+        stateAgent.Iteration = 0;
+        return stateAgent;
+    }
 
-            outTransition.push_back(" [");
+    stateAgent = *previous;
 
-            temp = *s;
-            outTransition.push_back(temp);
+    //If the number of finished tasks was the number of tasks of the agent in the step before, the iteration increases and the finished tasks are removed.
+    bool rollover = stateAgent.FinishedTasks.size() == globs.agentsTaskNo.at(j).no;
 
-            while (++s != se)
+    for (int k = 0; k < action.Agents.size(); k++)
+    {
+        if (j == action.Agents.at(k).Id)
+        {
+            if (action.Agents.at(k).Type == globs.taskStart)
             {
-                outTransition.push_back(",");
-                temp = *s;
-                outTransition.push_back(temp);
+                stateAgent.Task = action.Agents.at(k).Target;
             }
 
-            outTransition.push_back(temp = "]");
+            //Each task is only listed once
+            else if (action.Agents.at(k).Type == globs.taskFinish && !rollover)
+            {
+                stateAgent.FinishedTasks.insert(previous->Task);
+            }
         }
+    }
+
+    if (rollover)
+    {
+        stateAgent.Iteration++;
+        stateAgent.FinishedTasks.clear();
+    }
+
+    return stateAgent;
+}
 
-        outTransition.push_back(" {");
-        outTransition.push_back(expressions[guard]);
-        outTransition.push_back("; ");
-        outTransition.push_back(expressions[sync]);
-        outTransition.push_back("; ");
-        outTransition.push_back(expressions[update]);
-        outTransition.push_back(";} ");
-        outTrans.push_back(outTransition);
+//Fills the parsed state of one step from its unparsed state, the action of the same step and the parsed state of the step before. previous is null for the first step.
+parsed_state parseState(const state_cursor& unParsedState, const parsed_action& action, const parsed_state* previous)
+{
+    parsed_state state;
+    state.Agents.reserve(globs.noOfAgents);
+    for (int j = 0; j < globs.noOfAgents; j++)
+    {
+        state.Agents.push_back(parseStateAgent(unParsedState, action, previous == nullptr ? nullptr : &previous->Agents.at(j), j));
     }
-    unParsedTransition.push_back(outTrans);
-    return o;
+    return state;
 }
 
-/* Read and print a trace file.
+/* Parsed steps that were moved out of memory by --memory-limit. They
+ * are written to a temporary file in the order they were parsed, each
+ * step as its length followed by its state and action, and are read
+ * back in the same order when the results are printed. The file is
+ * removed when it is closed.
  */
-void loadTrace(istream& file)
+class result_spill
 {
-    cout << State(file);
+public:
+    result_spill();
+    result_spill(const result_spill&) = delete;
+    result_spill& operator=(const result_spill&) = delete;
+    ~result_spill() { fclose(file); }
+
+    void write(const parsed_state& state, const parsed_action& action);
+    void rewind();
+    bool read(parsed_state& state, parsed_action& action);
+    size_t size() const { return count; }
+private:
+    FILE* file;
+    size_t count = 0;
+    string buffer;
+};
 
-    for (;;)
+result_spill::result_spill() : file(tmpfile())
+{
+    if (file == nullptr)
     {
-        /* Skip white space. */
-        file >> skipspaces;
+        throw std::runtime_error("Cannot create a temporary file for --memory-limit");
+    }
+}
 
-        /* A dot terminates the trace. */
-        if (file.peek() == '.')
+void result_spill::write(const parsed_state& state, const parsed_action& action)
+{
+    snapshot_writer out;
+    out.put<uint64_t>(state.Agents.size());
+    for (auto& agent : state.Agents)
+    {
+        out.put(agent.Id);
+        out.put(agent.Milestone.name);
+        out.put(agent.Milestone.value);
+        out.put(agent.Task);
+        out.put<uint64_t>(agent.FinishedTasks.size());
+        for (size_t k = 0; k < agent.FinishedTasks.size(); k++)
         {
-            file.get();
-            break;
+            out.put(agent.FinishedTasks.at(k));
         }
+        out.put(agent.Iteration);
+    }
+    out.put<uint64_t>(action.Agents.size());
+    for (auto& agent : action.Agents)
+    {
+        out.put(agent.Id);
+        out.put(agent.Type);
+        out.put(agent.Target);
+        out.put(agent.TimeInt);
+    }
 
-        /* Read a state and a transition. */
-        State state(file);
-        Transition transition(file);
+    uint64_t length = out.buffer.size();
+    if (fwrite(&length, sizeof(length), 1, file) != 1
+        || fwrite(out.buffer.data(), 1, out.buffer.size(), file) != out.buffer.size())
+    {
+        throw std::runtime_error("Cannot write to the temporary file of --memory-limit");
+    }
+    count++;
+}
 
-        /* Print transition and state. */
-        cout << transition;
-        cout << state;
+void result_spill::rewind()
+{
+    fflush(file);
+    fseek(file, 0, SEEK_SET);
+}
+
+bool result_spill::read(parsed_state& state, parsed_action& action)
+{
+    uint64_t length;
+    if (fread(&length, sizeof(length), 1, file) != 1)
+    {
+        return false;
+    }
+    buffer.resize(length);
+    if (fread(&buffer[0], 1, length, file) != length)
+    {
+        throw std::runtime_error("The temporary file of --memory-limit is truncated");
+    }
 
+    snapshot_reader in{ buffer.data(), buffer.data() + buffer.size() };
+    uint64_t agents;
+    bool ok = in.get(agents);
+    state.Agents.resize(ok ? agents : 0);
+    vector<symbol_t> finished;
+    for (auto& agent : state.Agents)
+    {
+        ok = ok && in.get(agent.Id) && in.get(agent.Milestone.name) && in.get(agent.Milestone.value)
+            && in.get(agent.Task) && in.get(finished) && in.get(agent.Iteration);
+        agent.FinishedTasks.clear();
+        for (symbol_t task : finished)
+        {
+            agent.FinishedTasks.insert(task);
+        }
+    }
+    ok = ok && in.get(agents);
+    action.Agents.resize(ok ? agents : 0);
+    for (auto& agent : action.Agents)
+    {
+        ok = ok && in.get(agent.Id) && in.get(agent.Type) && in.get(agent.Target) && in.get(agent.TimeInt);
+    }
+    if (!ok)
+    {
+        throw std::runtime_error("The temporary file of --memory-limit is corrupt");
     }
+    return true;
 }
-///////////////////////////////////////////// code from tracer.cpp ends here
 
+/* Roughly the memory taken by one parsed step.
+ */
+size_t parsedSize(const parsed_state& state, const parsed_action& action)
+{
+    size_t size = sizeof(state) + sizeof(action);
+    for (auto& agent : state.Agents)
+    {
+        size += sizeof(agent) + agent.Milestone.name.capacity() + agent.FinishedTasks.heapSize();
+    }
+    for (auto& agent : action.Agents)
+    {
+        size += sizeof(agent) + agent.Type.capacity() + agent.TimeInt.capacity() * sizeof(int);
+    }
+    return size;
+}
 
-//Fills the agen locations
-//This is so the id of agents and their locations can be matched together.
-void fillAgentsLocations()
+//Parses the states of the trace with the agents split over agentThreads threads. The state of an agent only depends on its own
+//state in the step before and the actions of its own processes, so each thread runs through the whole trace for its agents
+//and writes them into the states of each step. The actions are parsed first, as they are needed by all threads.
+void parseResultsByAgent(const state_store& unParsedStates, const vector<transition_record>& transitions, parsed_result& parsed)
 {
-    if (processes.empty())
-        return;
-    else
+    size_t steps = unParsedStates.size() - 1;
+    parsed.Actions.reserve(steps);
+    for (size_t i = 1; i < unParsedStates.size(); i++)
     {
-        vector<string> agNames;
-        vector<string> procNames;
-        vector<int> startIndexOfNewName;
-        string prev = "";
+        parsed.Actions.push_back(parseAction(i < transitions.size() ? &transitions.at(i) : nullptr));
+    }
 
-        //I is one since i dont know any good way to ignore the Rong processes.
-        for (int i = globs.startOffset; i < processes.size(); i++)
-        {
-            process_t temp = processes.at(i);
-            string procName = temp.name;
+    parsed.States.resize(steps);
+    for (auto& state : parsed.States)
+    {
+        state.Agents.resize(globs.noOfAgents);
+    }
 
-            int index = procName.find_last_of("_") + 1;
-            string agName = procName.substr(index, procName.size() - index);
-            if (i != 1)
-            {
-                int added = 0;
-                for (int j = 0; j < agNames.size(); j++)
-                {
-                    if (agNames.at(j) == agName)
-                    {
-                        added = 1;
-                        break;
-                    }
-                }
-                if (added == 0)
-                {
-                    agNames.push_back(agName);
-                }
-            }
-            else
+    unsigned threadCount = std::min<unsigned>(agentThreads, globs.noOfAgents);
+
+    auto worker = [&](unsigned t) {
+        state_cursor unParsedState(unParsedStates);
+        for (size_t i = 0; i < steps; i++)
+        {
+            unParsedState.seek(i + 1);
+            for (int j = t; j < globs.noOfAgents; j += threadCount)
             {
-                agNames.push_back(agName);
-                startIndexOfNewName.push_back(i);
+                const parsed_state_agent* previous = i == 0 ? nullptr : &parsed.States[i - 1].Agents[j];
+                parsed.States[i].Agents[j] = parseStateAgent(unParsedState, parsed.Actions[i], previous, j);
             }
+        }
+    };
+
+    runWorkers(threadCount, worker);
+}
 
-            string name = procName.substr(0, index - 1);
-            procNames.push_back(name);
+//Parses the tracer to something that easily can be printet to an xml file.
+//With a spill, all but the last parsed step are moved to it whenever the parsed steps in memory take more than memoryLimit.
+void parseResults(const state_store& unParsedStates, const vector<transition_record>& transitions, parsed_result& parsed, result_spill* spill)
+{
+    if (unParsedStates.empty() || transitions.empty())
+    {
+        parsed.Result = 0;
+    }
+    else
+    {
+        parsed.Result = 1;
+
+        //The spill moves whole steps out of memory as they are parsed, so it is only used by the sequential parse.
+        if (agentThreads > 1 && globs.noOfAgents > 1 && spill == nullptr)
+        {
+            parseResultsByAgent(unParsedStates, transitions, parsed);
+            return;
         }
 
-        for (int i = 0; i < globs.noOfAgents; i++)
+        state_cursor unParsedState(unParsedStates);
+        size_t inMemory = 0;
+        for (size_t i = 1; i < unParsedStates.size(); i++)
         {
-            agent_locations agentLoc;
+            unParsedState.seek(i);
 
-            agentLoc.id = i;
-            agentLoc.name = agNames.at(i);
-            vector<string> locations;
+            //Filles the actions
+            parsed.Actions.push_back(parseAction(i < transitions.size() ? &transitions.at(i) : nullptr));
+
+            //Filles the parsed states.
+            const parsed_state* previous = parsed.States.empty() ? nullptr : &parsed.States.back();
+            parsed.States.push_back(parseState(unParsedState, parsed.Actions.back(), previous));
 
-            for (int j = 0; j < procNames.size(); j++)
+            if (spill != nullptr)
             {
-                for (int l = 0; l < processes.size(); l++)
+                inMemory += parsedSize(parsed.States.back(), parsed.Actions.back());
+                if (inMemory > memoryLimit)
                 {
-                    if (processes.at(l).name.find(agNames.at(i)) != string::npos && processes.at(l).name.find(procNames.at(j)) != string::npos)
+                    size_t last = parsed.States.size() - 1;
+                    for (size_t k = 0; k < last; k++)
                     {
-                        locations.push_back(procNames.at(j));
+                        spill->write(parsed.States[k], parsed.Actions[k]);
                     }
+                    parsed.States.erase(parsed.States.begin(), parsed.States.begin() + last);
+                    parsed.Actions.erase(parsed.Actions.begin(), parsed.Actions.begin() + last);
+                    inMemory = parsedSize(parsed.States.back(), parsed.Actions.back());
                 }
             }
-
-            agentLoc.locations = locations;
-            AgentsLocations.push_back(agentLoc);
         }
     }
+}
+
 
+//Prints the opening Traces tag with the result, followed by the start of the time line.
+void printXMLHeader(xmlw::XmlStream& xml, int result)
+{
+    xml << xmlw::prolog()
+        << xmlw::tag("Traces") << xmlw::attr("result") << result << xmlw::chardata() << xmlw::chardata() << "Time: " << xmlw::chardata();
 }
 
-//Parses the tracer to something that easily can be printet to an xml file.
-void parseResults()
+//Prints one parsed state.
+void printXMLState(xmlw::XmlStream& xml, const parsed_state& state)
 {
-    if (unParsedStates.empty() || unParsedTransition.empty())
+    xml << xmlw::chardata() << "    " << xmlw::tag("State") << xmlw::chardata() << "\n";
+
+    //First prints out the stage
+    for (int j = 0; j < state.Agents.size(); j++)
     {
-        results.Result = 0;
+        xml << xmlw::chardata() << "        "
+            << xmlw::tag("Agent") << xmlw::attr("id") << j << xmlw::chardata() << "\n"
+            << xmlw::chardata() << "            "
+            << xmlw::tag("Milestone") << xmlw::chardata() << state.Agents.at(j).Milestone.name << xmlw::endtag() << xmlw::chardata() << "\n"
+            << xmlw::chardata() << "            "
+            << xmlw::tag("Task") << xmlw::chardata() << symbols.name(state.Agents.at(j).Task) << xmlw::endtag() << xmlw::chardata() << "\n"
+            << xmlw::chardata() << "            "
+            << xmlw::tag("Finish") << xmlw::chardata() << "\n";
+
+        //Prints if there are any completed tasks
+        for (int k = 0; k < state.Agents.at(j).FinishedTasks.size(); k++)
+        {
+            xml << xmlw::chardata() << "                "
+                << xmlw::tag("Task")
+                << xmlw::chardata() << symbols.name(state.Agents.at(j).FinishedTasks.at(k))
+                << xmlw::endtag() << xmlw::chardata() << "\n";
+        }
+
+        xml << xmlw::chardata() << "            " << xmlw::endtag() << xmlw::chardata() << "\n"
+            << xmlw::chardata() << "            "
+            << xmlw::tag("Iteration") << xmlw::chardata() << state.Agents.at(j).Iteration << xmlw::endtag() << xmlw::chardata() << "\n"
+            << xmlw::chardata() << "        " << xmlw::endtag() << xmlw::chardata() << "\n";
     }
-    else
+    xml << xmlw::chardata() << "    " << xmlw::endtag() << xmlw::chardata() << "\n";
+}
+
+//Prints one parsed action.
+void printXMLAction(xmlw::XmlStream& xml, const parsed_action& action)
+{
+    xml << xmlw::chardata() << "    " << xmlw::tag("Action") << xmlw::chardata() << "\n";
+
+    for (int j = 0; j < action.Agents.size(); j++)
     {
-        results.Result = 1;
+        xml << xmlw::chardata() << "        "
+            << xmlw::tag("Agent") << xmlw::attr("id") << action.Agents.at(j).Id << xmlw::chardata() << "\n"
+            << xmlw::chardata() << "            "
+            << xmlw::tag("Type") << xmlw::chardata() << action.Agents.at(j).Type << xmlw::endtag() << xmlw::chardata() << "\n"
+            << xmlw::chardata() << "            "
+            << xmlw::tag("Target") << xmlw::chardata() << symbols.name(action.Agents.at(j).Target) << xmlw::endtag() << xmlw::chardata() << "\n"
+            << xmlw::chardata() << "            "
+            << xmlw::tag("Time") << xmlw::chardata() << action.Agents.at(j).TimeInt.at(0) << "-" << action.Agents.at(j).TimeInt.at(1)
+            << xmlw::endtag() << xmlw::chardata() << "\n"
+            << xmlw::chardata() << "        "
+            << xmlw::endtag() << xmlw::chardata() << "\n";
+    }
+    xml << xmlw::chardata() << "    " << xmlw::endtag() << xmlw::chardata() << "\n";
+}
 
-        for (int i = 1; i < unParsedStates.size(); i++)
-        {
+//Prints the parsed result into the inputfile and also provides the time for parsing
+//Warning. This just tries to print out all the data under specific tags and does not check if its a good xml file.
+//The steps moved to spill come before the ones in Result.
+void printParsedResultsToXMLFile(const parsed_result& Result, string file_name, long duration, result_spill* spill)
+{
+    ofstream file(file_name);
+    xmlw::XmlStream xml(file);
 
-            //Filles the actions
-            parsed_action action;
-            for (int j = 0; j < globs.noOfAgents; j++)
-            {
-                parsed_action_agent actionAgent;
+    printXMLHeader(xml, Result.Result);
+    xml << duration << xmlw::chardata() << "ms" << xmlw::chardata() << "\n";
 
-                if (!(i >= unParsedTransition.size()))
-                {
-                    int index = unParsedTransiNameLoc;
-                    int transiLocFrom = 0;
-                    int transiLocTo = 4;
+    size_t spilled = spill != nullptr ? spill->size() : 0;
+    size_t stateCount = spilled + Result.States.size();
+    if (spilled > 0)
+    {
+        parsed_state state;
+        parsed_action action;
+        spill->rewind();
+        while (spill->read(state, action))
+        {
+            //The spill never holds the final stage.
+            printXMLState(xml, state);
+            printXMLAction(xml, action);
+        }
+    }
 
-                    string transiFrom = unParsedTransition.at(i).at(index).at(transiLocFrom);
-                    if (transiFrom.find(AgentsLocations.at(j).name) != string::npos)
-                    {
-                        actionAgent.Id = j;
-
-                        //Need to fixer lower bound time;
-                        actionAgent.TimeInt.push_back(0);
-                        actionAgent.TimeInt.push_back(globs.maxTime);
-
-                        //Checks if the action move is in a task or a milestone
-                        //Task
-                        if (transiFrom.find(globs.taskNameIdentifier) != string::npos)
-                        {
-                            for (int f = 0; f < globs.taskStartFrom.size(); f++)
-                            {
-                                for (int t = 0; t < globs.taskStartTo.size(); t++)
-                                {
-                                    //Checks the combinations of values that means that a task is starting
-                                    if (unParsedTransition.at(i).at(index).at(transiLocFrom + 2).find(globs.taskStartFrom.at(f)) != string::npos
-                                        && unParsedTransition.at(i).at(index).at(transiLocTo + 2).find(globs.taskStartTo.at(t)) != string::npos)
-                                    {
-                                        actionAgent.Type = globs.taskStart;
-                                        actionAgent.Target = transiFrom + "." + unParsedTransition.at(i).at(index).at(transiLocTo + 2);
-                                    }
-                                }
-                            }
-
-                            for (int f = 0; f < globs.taskFinishFrom.size(); f++)
-                            {
-                                for (int t = 0; t < globs.taskFinishTo.size(); t++)
-                                {
-                                    //Checks the combinations of values that means that a task is done
-                                    if (unParsedTransition.at(i).at(index).at(transiLocFrom + 2).find(globs.taskFinishFrom.at(f)) != string::npos
-                                        && unParsedTransition.at(i).at(index).at(transiLocTo + 2).find(globs.taskFinishTo.at(t)) != string::npos)
-                                    {
-                                        actionAgent.Type = globs.taskFinish;
-                                        actionAgent.Target = transiFrom + "." + unParsedTransition.at(i).at(index).at(transiLocTo + 2);
-                                    }
-                                }
-                            }
-                        }
-
-                        //Milestones
-                        else if (transiFrom.find(globs.milestoneNameIdentifier) != string::npos)
-                        {
-                            for (int f = 0; f < globs.moveStartFrom.size(); f++)
-                            {
-                                for (int t = 0; t < globs.moveStartTo.size(); t++)
-                                {
-                                    //Checks the combinations of values that means that a move is starting
-                                    if (unParsedTransition.at(i).at(index).at(transiLocFrom + 2).find(globs.moveStartFrom.at(f)) != string::npos
-                                        && unParsedTransition.at(i).at(index).at(transiLocTo + 2).find(globs.moveStartTo.at(t)) != string::npos)
-                                    {
-                                        actionAgent.Type = globs.moveStart;
-                                        actionAgent.Target = transiFrom + "." + unParsedTransition.at(i).at(index).at(transiLocTo + 2);
-                                    }
-                                }
-                            }
-
-                            for (int f = 0; f < globs.moveFinishFrom.size(); f++)
-                            {
-                                for (int t = 0; t < globs.moveFinishTo.size(); t++)
-                                {
-                                    //Checks the combinations of values that means that a move is done
-                                    if (unParsedTransition.at(i).at(index).at(transiLocFrom + 2).find(globs.moveFinishFrom.at(f)) != string::npos
-                                        && unParsedTransition.at(i).at(index).at(transiLocTo + 2).find(globs.moveFinishTo.at(t)) != string::npos)
-                                    {
-                                        actionAgent.Type = globs.moveFinish;
-                                        actionAgent.Target = transiFrom + "." + unParsedTransition.at(i).at(index).at(transiLocTo + 2);
-                                    }
-                                }
-                            }
-
-                        }
-                        action.Agents.push_back(actionAgent);
-                    }
-                }
-            }
-            results.Actions.push_back(action);
+    for (size_t i = spilled; i < stateCount; i++)
+    {
+        printXMLState(xml, Result.States.at(i - spilled));
 
-            //Filles the parsed states.
-            parsed_state state;
-            for (int j = 0; j < globs.noOfAgents; j++)
-            {
-                parsed_state_agent stateAgent;
+        //Prints out the action after that, as long as is not the final stage.
+        if (i < stateCount - 1)
+        {
+            printXMLAction(xml, Result.Actions.at(i - spilled));
+        }
+    }
+    xml << xmlw::endtag();
+}
 
-                for (int k = 0; k < unParsedStates.at(i).size(); k++)
-                {
-                    //Should be changed to something that can be added into globs.
+/* Parses each step as soon as it has been read and prints it to the
+ * XML file right away. Only the last state read and the last parsed
+ * state are kept, so memory use does not grow with the trace.
+ *
+ * The parse time is not known when the header is printed. Room is
+ * left for it after "Time: " and filled in by finish().
+ */
+class trace_streamer : public trace_sink
+{
+public:
+    explicit trace_streamer(const string& file_name) : file(file_name), xml(file) {}
 
-                    string find = "agents[" + to_string(j) + "]" + ".a_position";
-                    string variable = unParsedStates.at(i).at(k);
-                    //Gets the int value from the unParsedStates and matches it with the milestoneValue
-                    if (variable.find(find) != string::npos)
-                    {
-                        string value = variable.substr(variable.find("=") + 1, variable.size() - variable.find("=") - 1);
-                        for (int l = 0; l < globs.milestoneValues.size(); l++)
-                        {
-                            if (globs.milestoneValues.at(l).value == stoi(value))
-                            {
-                                stateAgent.Milestone = globs.milestoneValues.at(l);
-                            }
-                        }
-                    }
-                }
+    void state(const State& s) override
+    {
+        lastState.clear();
+        lastState.push_back(s);
+        stateCount++;
+    }
 
-                if (i == 1)
-                {
-                    stateAgent.Id = j;
-                    stateAgent.Iteration = 0;
-                    state.Agents.push_back(stateAgent);
-                }
+    void transition(const Transition& t) override
+    {
+        //The transition into the first parsed state is never used.
+        if (stateCount > 1)
+        {
+            transition_record recorded = recordTransition(t, &pool);
+            step(&recorded);
+        }
+    }
 
-                else
-                {
-                    parsed_action prevAction = results.Actions.back();
-                    stateAgent = results.States.back().Agents.at(j);
-                    vector<string> compTask = stateAgent.FinishedTasks;
+    //Parses the last step and completes the XML file.
+    void finish()
+    {
+        if (stateCount > 1)
+        {
+            step(nullptr);
+        }
+        else
+        {
+            printHeader(0);
+        }
+        xml << xmlw::endtag();
 
+        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(elapsed);
+        string time = to_string(duration.count()) + "ms";
+        file.seekp(timePosition);
+        file << time.substr(0, timeWidth);
+    }
 
-                    for (int k = 0; k < prevAction.Agents.size(); k++)
-                    {
-                        if (j == prevAction.Agents.at(k).Id)
-                        {
-                            if (prevAction.Agents.at(k).Type == globs.taskStart)
-                            {
-                                stateAgent.Task = prevAction.Agents.at(k).Target;
-                            }
-
-                            else if (prevAction.Agents.at(k).Type == globs.taskFinish)
-                            {
-                                string task = results.States.back().Agents.at(j).Task;
-                                int added = 0;
-                                //Makes sure that there is only one ex of each task in the compTask list
-                                for (int l = 0; l < compTask.size(); l++)
-                                {
-                                    if (compTask.at(l) == task)
-                                    {
-                                        added = 1;
-                                        break;
-                                    }
-                                }
-
-                                if (added == 0)
-                                {
-                                    compTask.push_back(task);
-                                }
-                            }
-                        }
-                    }
+private:
+    static const size_t timeWidth = 24;
 
-                    //If the size of the comptask is the size of the task for the agent then the iteration will increase on and the list of comptask will be removed.
-                    if (stateAgent.FinishedTasks.size() == globs.agentsTaskNo.at(j).no)
-                    {
-                        stateAgent.Iteration++;
-                        stateAgent.FinishedTasks.clear();
-                    }
-                    else
-                        stateAgent.FinishedTasks = compTask;
+    void printHeader(int result)
+    {
+        printXMLHeader(xml, result);
+        timePosition = file.tellp();
+        xml << string(timeWidth, ' ') << xmlw::chardata() << "\n";
+    }
+
+    void step(const transition_record* transition)
+    {
+        bool first = !started;
+        if (first)
+        {
+            printHeader(1);
+            started = true;
+        }
 
-                    state.Agents.push_back(stateAgent);
+        auto start = std::chrono::high_resolution_clock::now();
+        parsed_action action = parseAction(transition);
+        lastCursor.seek(0);
+        parsed_state state = parseState(lastCursor, action, first ? nullptr : &previous);
+        elapsed += std::chrono::high_resolution_clock::now() - start;
 
-                }
-            }
-            results.States.push_back(state);
+        printXMLState(xml, state);
+        //The last state has no action after it.
+        if (transition != nullptr)
+        {
+            printXMLAction(xml, action);
         }
+        previous = std::move(state);
     }
-}
 
+    ofstream file;
+    xmlw::XmlStream xml;
+    //Only one transition is kept at a time, its memory is reused.
+    std::pmr::unsynchronized_pool_resource pool;
+    state_store lastState;
+    state_cursor lastCursor{ lastState };
+    parsed_state previous;
+    size_t stateCount = 0;
+    bool started = false;
+    std::streampos timePosition;
+    std::chrono::high_resolution_clock::duration elapsed{};
+};
 
-//Prints the parsed result into the inputfile and also provides the time for parsing
-//Warning. This just tries to print out all the data under specific tags and does not check if its a good xml file.
-void printParsedResultsToXMLFile(parsed_result Result, string file_name, long duration)
+//Converts one trace of a batch into its output file. Only reads the model tables, so several traces can be converted at the same time.
+void convertTrace(const string& traceFile, const string& outputFile)
 {
-    ofstream file(file_name);
-    xmlw::XmlStream xml(file);
-
-    xml << xmlw::prolog()
-        << xmlw::tag("Traces") << xmlw::attr("result") << results.Result << xmlw::chardata() << xmlw::chardata() << "Time: " << xmlw::chardata() << duration << xmlw::chardata() << "ms" << xmlw::chardata() << "\n";
+    //A trace that turns out to be malformed leaves no half written output behind.
+    if (streamOutput)
+    {
+        try
+        {
+            trace_streamer streamer(outputFile);
+            readTrace(traceFile, streamer);
+            streamer.finish();
+        }
+        catch (invalid_format&)
+        {
+            std::remove(outputFile.c_str());
+            throw;
+        }
+        return;
+    }
 
-    for (int i = 0; i < results.States.size(); i++)
+    trace_arena arena;
+    state_store traceStates;
+    vector<transition_record> traceTransitions;
+    parsed_result traceResults;
+    std::unique_ptr<result_spill> spill;
+    if (memoryLimit > 0)
     {
-        xml << xmlw::chardata() << "    " << xmlw::tag("State") << xmlw::chardata() << "\n";
+        spill = std::make_unique<result_spill>();
+    }
 
-        //First prints out the stage
-        for (int j = 0; j < results.States.at(i).Agents.size(); j++)
-        {
-            xml << xmlw::chardata() << "        "
-                << xmlw::tag("Agent") << xmlw::attr("id") << j << xmlw::chardata() << "\n"
-                << xmlw::chardata() << "            "
-                << xmlw::tag("Milestone") << xmlw::chardata() << results.States.at(i).Agents.at(j).Milestone.name << xmlw::endtag() << xmlw::chardata() << "\n"
-                << xmlw::chardata() << "            "
-                << xmlw::tag("Task") << xmlw::chardata() << results.States.at(i).Agents.at(j).Task << xmlw::endtag() << xmlw::chardata() << "\n"
-                << xmlw::chardata() << "            "
-                << xmlw::tag("Finish") << xmlw::chardata() << "\n";
+    trace_collector collector(traceStates, traceTransitions, arena);
+    readTrace(traceFile, collector);
 
-            //Prints if there are any completed tasks
-            for (int k = 0; k < results.States.at(i).Agents.at(j).FinishedTasks.size(); k++)
-            {
-                xml << xmlw::chardata() << "                "
-                    << xmlw::tag("Task")
-                    << xmlw::chardata() << results.States.at(i).Agents.at(j).FinishedTasks.at(k)
-                    << xmlw::endtag() << xmlw::chardata() << "\n";
-            }
+    auto start = std::chrono::high_resolution_clock::now();
+    parseResults(traceStates, traceTransitions, traceResults, spill.get());
+    auto stop = std::chrono::high_resolution_clock::now();
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
+
+    printParsedResultsToXMLFile(traceResults, outputFile, duration.count(), spill.get());
+}
+
+//Converts every trace listed in the batch file on threadCount threads.
+//Each line holds a trace file, optionally followed by a tab and the output file. Without an output file the trace file name with .xml appended is used.
+int runBatch(const string& batchFile, unsigned threadCount)
+{
+    ifstream file(batchFile);
+    if (!file)
+    {
+        cerr << "Cannot open batch file " << batchFile << endl;
+        return EXIT_FAILURE;
+    }
 
-            xml << xmlw::chardata() << "            " << xmlw::endtag() << xmlw::chardata() << "\n"
-                << xmlw::chardata() << "            "
-                << xmlw::tag("Iteration") << xmlw::chardata() << results.States.at(i).Agents.at(j).Iteration << xmlw::endtag() << xmlw::chardata() << "\n"
-                << xmlw::chardata() << "        " << xmlw::endtag() << xmlw::chardata() << "\n";
+    vector<std::pair<string, string>> jobs;
+    string line;
+    while (getline(file, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        if (line.empty())
+        {
+            continue;
+        }
+        size_t tab = line.find('\t');
+        if (tab == string::npos)
+        {
+            jobs.emplace_back(line, line + ".xml");
+        }
+        else
+        {
+            jobs.emplace_back(line.substr(0, tab), line.substr(tab + 1));
         }
-        xml << xmlw::chardata() << "    " << xmlw::endtag() << xmlw::chardata() << "\n";
+    }
 
-        //Prints out the action after that, as long as is not the final stage.
-        if (i < results.States.size() - 1)
+    std::atomic<size_t> nextJob(0);
+    std::atomic<int> failed(0);
+    std::mutex outputLock;
+    auto worker = [&](unsigned)
+    {
+        size_t j;
+        while ((j = nextJob++) < jobs.size())
         {
-            xml << xmlw::chardata() << "    " << xmlw::tag("Action") << xmlw::chardata() << "\n";
+            const string& traceFile = jobs[j].first;
+            const string& outputFile = jobs[j].second;
+            try
+            {
+                if (!ifstream(traceFile))
+                {
+                    throw invalid_format("Cannot open trace file " + traceFile);
+                }
+                convertTrace(traceFile, outputFile);
 
-            for (int j = 0; j < results.Actions.at(i).Agents.size(); j++)
+                std::lock_guard<std::mutex> lock(outputLock);
+                cout << traceFile << " -> " << outputFile << endl;
+            }
+            catch (std::exception& e)
             {
-                xml << xmlw::chardata() << "        "
-                    << xmlw::tag("Agent") << xmlw::attr("id") << j << xmlw::chardata() << "\n"
-                    << xmlw::chardata() << "            "
-                    << xmlw::tag("Type") << xmlw::chardata() << results.Actions.at(i).Agents.at(j).Type << xmlw::endtag() << xmlw::chardata() << "\n"
-                    << xmlw::chardata() << "            "
-                    << xmlw::tag("Target") << xmlw::chardata() << results.Actions.at(i).Agents.at(j).Target << xmlw::endtag() << xmlw::chardata() << "\n"
-                    << xmlw::chardata() << "            "
-                    << xmlw::tag("Time") << xmlw::chardata() << results.Actions.at(i).Agents.at(j).TimeInt.at(0) << "-" << results.Actions.at(i).Agents.at(j).TimeInt.at(1)
-                    << xmlw::endtag() << xmlw::chardata() << "\n"
-                    << xmlw::chardata() << "        "
-                    << xmlw::endtag() << xmlw::chardata() << "\n";
+                std::lock_guard<std::mutex> lock(outputLock);
+                cerr << traceFile << ": " << e.what() << endl;
+                failed++;
             }
-            xml << xmlw::chardata() << "    " << xmlw::endtag() << xmlw::chardata() << "\n";
         }
+    };
+
+    runWorkers(static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(threadCount, jobs.size()))), worker);
+
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+//Reads the number given to an option. Returns false if text is not a plain decimal number or is larger than max.
+bool parseCount(const string& text, unsigned long long max, unsigned long long& value)
+{
+    if (text.empty() || text.find_first_not_of("0123456789") != string::npos)
+    {
+        return false;
     }
-    xml << xmlw::endtag();
+    try
+    {
+        value = stoull(text);
+    }
+    catch (std::out_of_range&)
+    {
+        return false;
+    }
+    return value <= max;
+}
+
+//Reads the number of threads given to an option, 0 being one thread per core.
+bool parseThreadCount(const string& text, unsigned& threads)
+{
+    unsigned long long count;
+    if (!parseCount(text, std::numeric_limits<unsigned>::max(), count))
+    {
+        return false;
+    }
+    threads = count == 0 ? std::max(1u, std::thread::hardware_concurrency()) : static_cast<unsigned>(count);
+    return true;
+}
+
+//Prints how the program is run.
+void printUsage(const char* program)
+{
+    cerr << "Usage: " << program << " [--legacy-reader] [--check-reader] [--stream] [--if-cache] [--print-trace] [--verbose] [--threads N] [--agent-threads N] [--memory-limit MB] [--batch FILE]"
+         << " [globs [intermediate|- [trace|- [output]]]]" << endl;
 }
 
 string getUserInput()
@@ -1346,6 +4056,22 @@ void fillGlobs(vector<string> lines)
     globs.startOffset = stoi(lines.at(findIndexOfGlobs(lines, "//startOffset")));
 
     globs.noOfAgents = stoi(lines.at(findIndexOfGlobs(lines, "//noOfAgents")));
+
+    //All location patterns in one matcher, so a location name is only scanned once.
+    const std::pair<const vector<string>*, uint32_t> patterns[] = {
+        { &globs.moveStartFrom, MOVE_START_FROM }, { &globs.moveStartTo, MOVE_START_TO },
+        { &globs.moveFinishFrom, MOVE_FINISH_FROM }, { &globs.moveFinishTo, MOVE_FINISH_TO },
+        { &globs.taskStartFrom, TASK_START_FROM }, { &globs.taskStartTo, TASK_START_TO },
+        { &globs.taskFinishFrom, TASK_FINISH_FROM }, { &globs.taskFinishTo, TASK_FINISH_TO } };
+    locationPatterns.clear();
+    for (auto& category : patterns)
+    {
+        for (auto& pattern : *category.first)
+        {
+            locationPatterns.add(pattern, category.second);
+        }
+    }
+    locationPatterns.build();
 }
 
 int main(int argc, char* argv[])
@@ -1355,14 +4081,167 @@ int main(int argc, char* argv[])
     string ifFile;
     string traceFile;
     string globsFile;
+    string batchFile;
+    vector<string> files;
+    std::unique_ptr<result_spill> spill;
+
+    //Command line options.
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+
+        //Reads the trace with istream extraction instead of mapping it into memory.
+        if (arg == "--legacy-reader")
+        {
+            legacyReader = true;
+        }
+        //Reads the trace with both readers and fails if they disagree.
+        else if (arg == "--check-reader")
+        {
+            checkReader = true;
+        }
+        //Prints each step to the output file as soon as it is read instead of keeping the whole trace.
+        else if (arg == "--stream")
+        {
+            streamOutput = true;
+        }
+        //Loads the intermediate file from a binary snapshot kept next to it.
+        else if (arg == "--if-cache")
+        {
+            ifCache = true;
+        }
+        //Moves parsed steps to a temporary file once they take more than this many megabytes.
+        else if (arg == "--memory-limit" && i + 1 < argc)
+        {
+            unsigned long long megabytes;
+            if (!parseCount(argv[++i], std::numeric_limits<size_t>::max() >> 20, megabytes))
+            {
+                cerr << "Invalid memory limit: " << argv[i] << endl;
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            memoryLimit = static_cast<size_t>(megabytes) << 20;
+        }
+        //Prints the trace as text to standard output, the way the UPPAAL tracer does.
+        else if (arg == "--print-trace")
+        {
+            printTrace = true;
+        }
+        //Prints the guards, synchronisations and updates of the edges with --print-trace.
+        else if (arg == "--verbose")
+        {
+            verboseTrace = true;
+        }
+        //Converts the traces listed in a file instead of asking for one trace and output file.
+        else if (arg == "--batch" && i + 1 < argc)
+        {
+            batchFile = argv[++i];
+        }
+        //Parses the trace on several threads, or converts that many traces at once with --batch. 0 uses one thread per core.
+        else if (arg == "--threads" && i + 1 < argc)
+        {
+            if (!parseThreadCount(argv[++i], traceThreads))
+            {
+                cerr << "Invalid number of threads: " << argv[i] << endl;
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+        //Splits the agents over several threads when the parsed states are filled. 0 uses one thread per core.
+        else if (arg == "--agent-threads" && i + 1 < argc)
+        {
+            if (!parseThreadCount(argv[++i], agentThreads))
+            {
+                cerr << "Invalid number of threads: " << argv[i] << endl;
+                printUsage(argv[0]);
+                return EXIT_FAILURE;
+            }
+        }
+        //The files can be given in the order they are asked for instead of at the prompts, - is standard input.
+        else if (arg.compare(0, 2, "--") != 0 && files.size() < (batchFile.empty() ? 4 : 2))
+        {
+            files.push_back(arg);
+        }
+        else
+        {
+            cerr << "Unknown option: " << arg << endl;
+            printUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    //Options that would have no effect together are rejected rather than ignored.
+    const char* conflict = nullptr;
+    //The printed traces of a batch would run into each other.
+    if (printTrace && !batchFile.empty())
+    {
+        conflict = "--print-trace cannot be used with --batch";
+    }
+    //A streamed or printed trace is read in order on one thread. With --batch, --threads converts several traces at once instead.
+    else if (traceThreads > 1 && batchFile.empty() && (streamOutput || printTrace))
+    {
+        conflict = streamOutput ? "--threads cannot be used with --stream" : "--threads cannot be used with --print-trace";
+    }
+    //The streamed output keeps no parsed states, and the spill needs the steps in order as they are parsed.
+    else if (agentThreads > 1 && (streamOutput || memoryLimit > 0))
+    {
+        conflict = streamOutput ? "--agent-threads cannot be used with --stream" : "--agent-threads cannot be used with --memory-limit";
+    }
+    if (conflict != nullptr)
+    {
+        cerr << conflict << endl;
+        printUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    files.resize(4);
+    globsFile = files[0];
+    ifFile = files[1];
+    traceFile = files[2];
+    outputFile = files[3];
+
+    if (!globsFile.empty() && !ifstream(globsFile))
+    {
+        cerr << "Cannot open globs file: " << globsFile << endl;
+        return EXIT_FAILURE;
+    }
+    if (!ifFile.empty() && !isReadable(ifFile))
+    {
+        cerr << "Cannot open intermidiate file: " << ifFile << endl;
+        return EXIT_FAILURE;
+    }
+    if (!traceFile.empty() && !isReadable(traceFile))
+    {
+        cerr << "Cannot open trace file: " << traceFile << endl;
+        return EXIT_FAILURE;
+    }
+
+    //Standard input holds the piped file, so nothing else can be asked for.
+    if (ifFile == "-" || traceFile == "-")
+    {
+        if (ifFile == "-" && traceFile == "-")
+        {
+            cerr << "Only one of the intermidiate file and the trace can be read from standard input" << endl;
+            return EXIT_FAILURE;
+        }
+        if (globsFile.empty() || ifFile.empty() || (batchFile.empty() && (traceFile.empty() || outputFile.empty())))
+        {
+            cerr << "All files have to be given on the command line when one of them is -" << endl;
+            return EXIT_FAILURE;
+        }
+        std::ios::sync_with_stdio(false);
+    }
 
     try
     {
         //Fill globs struct
         do
         {
-            printf("Please input the globs file: ");
-            globsFile = getUserInput();
+            if (globsFile.empty())
+            {
+                printf("Please input the globs file: ");
+                globsFile = getUserInput();
+            }
             ifstream file(globsFile);
 
             if(!file)
@@ -1393,49 +4272,113 @@ int main(int argc, char* argv[])
         //Load intermidiate file
         do
         {
-            printf("Please input the intermidiate file: ");
-            ifFile = getUserInput();
-            ifstream file(ifFile);
+            if (ifFile.empty())
+            {
+                printf("Please input the intermidiate file: ");
+                ifFile = getUserInput();
+            }
 
-            if (!file)
+            if (!isReadable(ifFile))
             {
                 printf("Please input an existing intermidiate file!\n");
                 ifFile = "";           
             }
+#ifdef ENABLE_LIBUTAP
+            //An UPPAAL model is loaded directly, no intermediate file needed.
+            else if (ifFile.size() > 4 && ifFile.compare(ifFile.size() - 4, 4, ".xml") == 0)
+            {
+                loadModelXML(ifFile);
+            }
+#endif
+            else if (ifCache)
+            {
+                loadIFCached(ifFile);
+            }
             else
             {
-                loadIF(file);
-                file.close();
+                input_file input(ifFile);
+                loadIF(input);
             }
 
         } while (ifFile.empty());
 
-        //Load trace
+        internModelNames();
+        resolveAgentSlots();
+        classifyEdges();
+        fillProcessAgents();
+
+        //Converts all traces of the batch against the model loaded above.
+        if (!batchFile.empty())
+        {
+            return runBatch(batchFile, traceThreads);
+        }
+
+        //Check trace
         do 
         {
-            printf("Please input the trace file: ");
-            traceFile = getUserInput();
-            ifstream file(traceFile);
+            if (traceFile.empty())
+            {
+                printf("Please input the trace file: ");
+                traceFile = getUserInput();
+            }
 
-            if (!file)
+            if (!isReadable(traceFile))
             {
                 printf("Please input an existing trace file!\n");
                 traceFile = "";
             }
-            else
-            {
-                loadTrace(file);
-                file.close();
-            }
         } while (traceFile.empty());
 
         do 
         {
-            printf("Please input the output file: ");
-            outputFile = getUserInput();
-            outputFile = outputFile;
+            if (outputFile.empty())
+            {
+                printf("Please input the output file: ");
+                outputFile = getUserInput();
+            }
         } while (outputFile.empty());
 
+        //Moves parsed steps to a temporary file beyond --memory-limit. The streamed output does not keep them.
+        if (memoryLimit > 0 && !streamOutput)
+        {
+            spill = std::make_unique<result_spill>();
+        }
+
+        //A malformed trace leaves nothing sensible to print.
+        try
+        {
+            if (checkReader)
+            {
+                checkTraceReader(traceFile);
+            }
+
+            //Load trace
+            if (streamOutput)
+            {
+                trace_streamer streamer(outputFile);
+                trace_printer printer(cout, streamer);
+                readTrace(traceFile, printTrace ? static_cast<trace_sink&>(printer) : streamer);
+                streamer.finish();
+                return 0;
+            }
+
+            //The trace is printed in order, so it is read on one thread.
+            if (traceThreads > 1 && !printTrace)
+            {
+                readTraceParallel(traceFile, traceStates, unParsedTransition, traceThreads, traceArena);
+            }
+            else
+            {
+                trace_collector collector(traceStates, unParsedTransition, traceArena);
+                trace_printer printer(cout, collector);
+                readTrace(traceFile, printTrace ? static_cast<trace_sink&>(printer) : collector);
+            }
+        }
+        catch (invalid_format& e)
+        {
+            cerr << traceFile << ": " << e.what() << endl;
+            return EXIT_FAILURE;
+        }
     }
     catch (std::exception& e)
 
@@ -1443,15 +4386,13 @@ int main(int argc, char* argv[])
         cerr << "Cought exception: " << e.what() << endl;
     }
 
-    fillAgentsLocations();
-
     //Start the timer.
     auto start = std::chrono::high_resolution_clock::now();
-    parseResults();
+    parseResults(traceStates, unParsedTransition, results, spill.get());
     auto stop = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
 
     //prints the result to xml.
-    printParsedResultsToXMLFile(results, outputFile, duration.count());
+    printParsedResultsToXMLFile(results, outputFile, duration.count(), spill.get());
 
 }
\ No newline at end of file